@@ -57,6 +57,11 @@ typedef struct ThreadControlBlock {
     // If running in subscription
     int inSubscription;
 
+    // For /metrics.
+    int64_t _Atomic itemsRun;
+    int64_t _Atomic busyNs;
+    int64_t _Atomic steals;
+
     // FOR DEBUGGING:
     int _Atomic _allocs;
     int _Atomic _frees;
@@ -67,6 +72,19 @@ extern ThreadControlBlock threads[THREADS_MAX];
 extern int _Atomic threadCount;
 extern __thread ThreadControlBlock* self;
 
+// Named counters that programs bump with __metricIncr (e.g., camera
+// and display frames), or gauges that they set with __metricSet, for
+// /metrics. Names are published once and never change, so readers
+// don't need a lock.
+typedef struct MetricCounter {
+    char name[120];
+    bool isGauge;
+    int64_t _Atomic value;
+} MetricCounter;
+#define METRIC_COUNTERS_MAX 256
+extern MetricCounter metricCounters[METRIC_COUNTERS_MAX];
+extern int _Atomic metricCountersCount;
+
 static inline int64_t timestamp_get(clockid_t clk_id) {
     // Returns timestamp in nanoseconds.
     struct timespec ts;
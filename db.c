@@ -5,6 +5,9 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
 
 #include <pthread.h>
 #include <signal.h>
@@ -101,6 +104,17 @@ typedef struct Destructor {
     void* arg;
 } Destructor;
 
+// Always-on counters for /metrics (see dbGetMetrics). They live out
+// here rather than in Db because the destroy paths don't have a Db.
+static _Atomic int64_t statementsCreated;
+static _Atomic int64_t statementsDestroyed;
+static _Atomic int64_t matchesCreated;
+static _Atomic int64_t matchesDestroyed;
+static _Atomic int64_t indexedStatements;
+static _Atomic int64_t destructorsRun;
+static _Atomic int64_t atomicallyVersionsCreated;
+static _Atomic int64_t atomicallyVersionsDestroyed;
+
 Destructor* destructorNew(void (*fn)(void*), void* arg) {
     Destructor* ret = malloc(sizeof(Destructor));
     ret->rc = 0;
@@ -113,6 +127,7 @@ void destructorRun(Destructor* d) {
     assert(d->fn != NULL);
     d->fn(d->arg);
     d->fn = NULL;
+    destructorsRun++;
 }
 
 static void destructorRetain(Destructor* d) {
@@ -171,6 +186,11 @@ void destructorSetReleaseAll(DestructorSet* set) {
     set->destructors = NULL;
 }
 
+// AtomicallyVersion refcounting (the struct is defined further
+// down). Both are no-ops on NULL.
+static void atomicallyVersionAcquire(AtomicallyVersion* v);
+static void atomicallyVersionRelease(AtomicallyVersion* v);
+
 // Statement datatype:
 
 typedef struct Statement {
@@ -188,7 +208,8 @@ typedef struct Statement {
     _Atomic long keepMs;
 
     // Will be NULL if not running in an Atomically
-    // convergence-tracking subgraph.
+    // convergence-tracking subgraph. The statement holds a reference
+    // on it until statementDestroy.
     AtomicallyVersion* atomicallyVersion;
 
     // Note that statement destructors are not mutable after statement
@@ -230,8 +251,14 @@ typedef struct Match {
     // -----
 
     // Will be NULL if not running in an Atomically
-    // convergence-tracking subgraph.
+    // convergence-tracking subgraph. The match holds a reference on
+    // it until matchDestroy.
     AtomicallyVersion* _Atomic atomicallyVersion;
+    // Set (while still alive) once the match is on its way to
+    // matchDestroy, and cleared at the end of matchDestroy, so that
+    // matchNew can't reuse the slot while the old match is still
+    // releasing its atomicallyVersion and destructors.
+    _Atomic bool isBeingDestroyed;
     // Set to true if ANY parent statement was removed but we kept the
     // Match alive.
     _Atomic bool parentWasRemoved;
@@ -285,8 +312,26 @@ typedef struct AtomicallyVersion {
     // Atomically times out), we walk all older versions' rootMatches
     // and NULL them out.
     Match* _Atomic rootMatch;
+
+    // References: one from the Atomically's allVersions list (until
+    // the version is reaped), plus one from every Statement and
+    // Match whose atomicallyVersion is this. Freed when this hits 0.
+    int _Atomic rc;
 } AtomicallyVersion;
 
+static void atomicallyVersionAcquire(AtomicallyVersion* v) {
+    if (v != NULL) { v->rc++; }
+}
+static void atomicallyVersionRelease(AtomicallyVersion* v) {
+    if (v != NULL && --v->rc == 0) {
+        // It's been reaped (that's the only way to drop the list's
+        // reference), so the reaper has already let go of rootMatch.
+        assert(v->rootMatch == NULL);
+        free(v);
+        atomicallyVersionsDestroyed++;
+    }
+}
+
 typedef struct AtomicallyVersionList {
     AtomicallyVersion* version;
     struct AtomicallyVersionList* next;
@@ -303,7 +348,10 @@ typedef struct Atomically {
     // versions.
     AtomicallyVersionList* _Atomic allVersions;
 
-    AtomicallyVersion* _Atomic latestConvergedVersion;
+    // Number of the newest version that has converged, or -1 if
+    // none has yet. (A number and not a pointer, since older
+    // versions get freed once they're reaped.)
+    int _Atomic latestConvergedNumber;
 
     // Records the last time that a version of this Atomically
     // converged. The sysmon will check this every 50ms or so and
@@ -414,7 +462,10 @@ static void listOfEdgeToDefragment(ListEdgeCheckerFn checker, void* checkerArg,
 ////////////////////////////////////////////////////////////
 
 Statement* statementAcquire(Db* db, StatementRef ref) {
-    if (ref.idx == 0) { return NULL; }
+    if (ref.idx == 0 ||
+        ref.idx >= sizeof(db->statementPool)/sizeof(db->statementPool[0])) {
+        return NULL;
+    }
 
     Statement* s = &db->statementPool[ref.idx];
     if (genRcAcquire(&s->genRc, ref.gen)) {
@@ -479,6 +530,7 @@ static StatementRef statementNew(Db* db, Clause* clause,
 
     // We should now have exclusive access to stmt, as its rc
     // is 0 and we were the ones who made it alive.
+    statementsCreated++;
 
     atomic_store(&stmt->clause, clause);
     stmt->keepMs = keepMs;
@@ -488,6 +540,7 @@ static StatementRef statementNew(Db* db, Clause* clause,
     // before the first reaction is dispatched.
     if (atomicallyVersion != NULL) {
         atomicallyVersion->inflightCount++;
+        atomicallyVersionAcquire(atomicallyVersion);
         stmt->atomicallyVersion = atomicallyVersion;
     } else {
         stmt->atomicallyVersion = NULL;
@@ -521,6 +574,9 @@ static void statementDestroy(Statement* stmt) {
     destructorSetReleaseAll(&stmt->destructorSet);
     pthread_mutex_unlock(&stmt->destructorSetMutex);
 
+    atomicallyVersionRelease(stmt->atomicallyVersion);
+    stmt->atomicallyVersion = NULL;
+
     Clause* stmtClause = statementClause(stmt);
     // Marks this statement slot as being fully free and ready for
     // reuse.
@@ -528,6 +584,7 @@ static void statementDestroy(Statement* stmt) {
 
     /* TracyCFreeS(stmt, 4); */
     clauseFree(stmtClause);
+    statementsDestroyed++;
 }
 
 Clause* statementClause(Statement* stmt) { return stmt->clause; }
@@ -669,6 +726,7 @@ void statementRemoveSelf(Db* db, Statement* stmt, bool doDeindex) {
         const Trie* newClauseToStatementRef;
         do {
             epochReset();
+            resultsCount = 0;
             oldClauseToStatementRef = db->clauseToStatementRef;
             newClauseToStatementRef =
                 trieRemove(db->clauseToStatementRef,
@@ -683,6 +741,9 @@ void statementRemoveSelf(Db* db, Statement* stmt, bool doDeindex) {
                                                &oldClauseToStatementRef,
                                                newClauseToStatementRef));
         epochEnd();
+        if (newClauseToStatementRef != oldClauseToStatementRef) {
+            indexedStatements -= resultsCount;
+        }
     }
 
     /* printf("reactToRemovedStatement: s%d:%d (%s)\n", stmt - &db->statementPool[0], stmt->gen, */
@@ -714,7 +775,10 @@ void statementRemoveSelf(Db* db, Statement* stmt, bool doDeindex) {
 ////////////////////////////////////////////////////////////
 
 Match* matchAcquire(Db* db, MatchRef ref) {
-    if (ref.idx == 0) { return NULL; }
+    if (ref.idx == 0 ||
+        ref.idx >= sizeof(db->matchPool)/sizeof(db->matchPool[0])) {
+        return NULL;
+    }
 
     Match* m = &db->matchPool[ref.idx];
     if (genRcAcquire(&m->genRc, ref.gen)) {
@@ -757,7 +821,8 @@ static MatchRef matchNew(Db* db,
         match = &db->matchPool[idx];
 
         GenRc oldGenRc = match->genRc;
-        if (oldGenRc.rc == 0 && !oldGenRc.alive && match->childStatements == NULL) {
+        if (oldGenRc.rc == 0 && !oldGenRc.alive && match->childStatements == NULL &&
+            !match->isBeingDestroyed) {
             GenRc newGenRc = oldGenRc;
             newGenRc.alive = true;
 
@@ -769,6 +834,7 @@ static MatchRef matchNew(Db* db,
     }
 
     // We should have exclusive access to match right now.
+    matchesCreated++;
 
     match->childStatements = listOfEdgeToNew(8);
     match->parentWasRemoved = false;
@@ -779,6 +845,7 @@ static MatchRef matchNew(Db* db,
     pthread_mutex_init(&match->childStatementsMutex, &mta);
     pthread_mutexattr_destroy(&mta);
 
+    atomicallyVersionAcquire(atomicallyVersion);
     match->atomicallyVersion = atomicallyVersion;
     match->workerThreadIndex = workerThreadIndex;
     match->isCompleted = false;
@@ -796,13 +863,19 @@ static void matchDestroy(Match* match) {
     pthread_mutex_lock(&match->destructorSetMutex);
     destructorSetReleaseAll(&match->destructorSet);
     pthread_mutex_unlock(&match->destructorSetMutex);
+
+    atomicallyVersionRelease(atomic_exchange(&match->atomicallyVersion, NULL));
+    matchesDestroyed++;
+    // Lets matchNew reuse this slot.
+    match->isBeingDestroyed = false;
 }
 
 AtomicallyVersion* matchAtomicallyVersion(Match* m) {
     return m->atomicallyVersion;
 }
 void matchSetAtomicallyVersion(Match* m, AtomicallyVersion* a) {
-    m->atomicallyVersion = a;
+    atomicallyVersionAcquire(a);
+    atomicallyVersionRelease(atomic_exchange(&m->atomicallyVersion, a));
 }
 
 static bool statementChecker(void* db, uint64_t ref) {
@@ -831,11 +904,11 @@ extern ThreadControlBlock threads[];
 extern void traceItem(char* buf, size_t bufsz, WorkQueueItem item);
 void matchRemoveSelf(Db* db, Match* match) {
     /* assert(match > &db->matchPool[0] && match < &db->matchPool[65536]); */
-    if (match->atomicallyVersion != NULL &&
-        match->atomicallyVersion->rootMatch == match &&
-        ((match->atomicallyVersion->atomically->latestConvergedVersion == NULL) ||
-         match->atomicallyVersion->number >=
-         match->atomicallyVersion->atomically->latestConvergedVersion->number)) {
+    AtomicallyVersion* atomicallyVersion = match->atomicallyVersion;
+    if (atomicallyVersion != NULL &&
+        atomicallyVersion->rootMatch == match &&
+        atomicallyVersion->number >=
+        atomicallyVersion->atomically->latestConvergedNumber) {
         // Skip this removal; this is a root match owned by an
         // AtomicallyVersion; leave it to the atomically reaper.
         match->parentWasRemoved = true;
@@ -855,6 +928,7 @@ void matchRemoveSelf(Db* db, Match* match) {
     // match (if they were added, then we wouldn't be able to remove
     // them).
     match->childStatements = NULL;
+    match->isBeingDestroyed = true;
     genRcMarkAsDead(&match->genRc);
     pthread_mutex_unlock(&match->childStatementsMutex);
 
@@ -914,6 +988,17 @@ void dbUnlockClauseToStatementRef(Db* db) {
 }
 
 // Query
+void dbGetMetrics(Db* db, DbMetrics* out) {
+    out->statementsCreated = statementsCreated;
+    out->statementsDestroyed = statementsDestroyed;
+    out->matchesCreated = matchesCreated;
+    out->matchesDestroyed = matchesDestroyed;
+    out->indexedStatements = indexedStatements;
+    out->destructorsRun = destructorsRun;
+    out->atomicallyVersionsCreated = atomicallyVersionsCreated;
+    out->atomicallyVersionsDestroyed = atomicallyVersionsDestroyed;
+}
+
 ResultSet* dbQuery(Db* db, Clause* pattern) {
     ResultSet *resultSet;
     size_t maxResults = 500;
@@ -942,6 +1027,22 @@ ResultSet* dbQuery(Db* db, Clause* pattern) {
     return resultSet;
 }
 
+typedef struct DbQueryVisitor {
+    void (*visit)(StatementRef ref, void* arg);
+    void* arg;
+} DbQueryVisitor;
+static void dbQueryVisitValue(uint64_t value, void* arg) {
+    DbQueryVisitor* visitor = arg;
+    visitor->visit((StatementRef) { .val = value }, visitor->arg);
+}
+void dbQueryVisit(Db* db, Clause* pattern,
+                  void (*visit)(StatementRef ref, void* arg), void* arg) {
+    epochBegin();
+    trieVisit(db->clauseToStatementRef, pattern, dbQueryVisitValue,
+              &(DbQueryVisitor) { visit, arg });
+    epochEnd();
+}
+
 AtomicallyVersion* dbFreshAtomicallyVersionOnKey(Db* db, const char* key,
                                                  MatchRef rootMatchRef) {
     mutexLock(&db->atomicallysMutex);
@@ -962,6 +1063,7 @@ AtomicallyVersion* dbFreshAtomicallyVersionOnKey(Db* db, const char* key,
                 atomically->key = strdup(key);
                 atomically->nextNumber = 0;
                 atomically->allVersions = NULL;
+                atomically->latestConvergedNumber = -1;
                 atomically->timeout = 100000000; // 100ms
                 atomically->latestConvergedTime = 0;
                 break;
@@ -976,8 +1078,10 @@ AtomicallyVersion* dbFreshAtomicallyVersionOnKey(Db* db, const char* key,
 
     AtomicallyVersion* atomicallyVersion = malloc(sizeof(AtomicallyVersion));
     atomicallyVersion->atomically = atomically;
-
-    // FIXME: assert old values are bad, do something with refcount
+    // This reference belongs to the allVersions list, and is
+    // released when the version gets reaped.
+    atomicallyVersion->rc = 1;
+    atomicallyVersionsCreated++;
 
     atomicallyVersion->number = atomically->nextNumber++;
     // An AtomicallyVersion should start unconverged, assuming that it
@@ -1032,6 +1136,9 @@ static void dbAtomicallyReapAllVersions(Db* db, Atomically* atomically,
                 }
                 matchRelease(db, rootMatch);
             }
+            // Whatever statements and matches are still on this
+            // version keep it alive until they're destroyed.
+            atomicallyVersionRelease(x->version);
             free(x);
         } else {
             // Keep this version - add to new list
@@ -1115,7 +1222,11 @@ void dbAtomicallyVersionInflightIncr(AtomicallyVersion* atomicallyVersion) {
 void dbAtomicallyVersionInflightDecr(Db* db, AtomicallyVersion* atomicallyVersion) {
     if (--atomicallyVersion->inflightCount == 0) {
         Atomically* atomically = atomicallyVersion->atomically;
-        atomically->latestConvergedVersion = atomicallyVersion;
+        // (An older version can converge after a newer one has.)
+        int latest = atomically->latestConvergedNumber;
+        while (latest < atomicallyVersion->number &&
+               !atomic_compare_exchange_weak(&atomically->latestConvergedNumber,
+                                             &latest, atomicallyVersion->number)) {}
         atomically->latestConvergedTime = timestamp_get(CLOCK_MONOTONIC);
         dbAtomicallyReapAllVersions(db, atomically, atomicallyVersion, false);
     }
@@ -1306,6 +1417,7 @@ Statement* dbInsertOrReuseStatement(Db* db, Clause* clause,
                                            &oldClauseToStatementRef,
                                            newClauseToStatementRef));
     epochEnd();
+    indexedStatements++;
 
     Statement* newStmt = statementAcquire(db, ref);
     assert(newStmt != NULL);
@@ -1504,6 +1616,7 @@ Statement* dbHoldStatement(Db* db,
             const Trie* newClauseToStatementRef;
             do {
                 epochReset();
+                resultsCount = 0;
                 oldClauseToStatementRef = db->clauseToStatementRef;
                 newClauseToStatementRef =
                     trieRemove(db->clauseToStatementRef,
@@ -1518,6 +1631,9 @@ Statement* dbHoldStatement(Db* db,
                                                    &oldClauseToStatementRef,
                                                    newClauseToStatementRef));
             epochEnd();
+            if (newClauseToStatementRef != oldClauseToStatementRef) {
+                indexedStatements -= resultsCount;
+            }
 
             statementRelease(db, oldStmtPtr);
         } else if (oldStmt.idx != 0) {
@@ -1541,3 +1657,357 @@ Statement* dbHoldStatement(Db* db,
         return NULL;
     }
 }
+
+////////////////////////////////////////////////////////////
+// Snapshot:
+////////////////////////////////////////////////////////////
+
+// Snapshot file format (version 1), all integers in native byte
+// order (a snapshot is only meant to be read back on the machine that
+// wrote it):
+//
+//     "FOLKSNAP" u32 formatVersion
+//     u32 nHolds, then per Hold:
+//         str key, f64 version, i64 keepMs,
+//         str sourceFileName, i32 sourceLineNumber,
+//         u32 nTerms, then nTerms * str term
+//     u32 nAtomicallys, then per Atomically:
+//         str key, i32 nextNumber
+//     u32 crc32 of everything above
+//
+// where str is u32 len followed by len bytes (no NUL).
+
+#define DB_SNAPSHOT_MAGIC "FOLKSNAP"
+#define DB_SNAPSHOT_FORMAT_VERSION 1
+
+typedef struct SnapshotBuf {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+} SnapshotBuf;
+static void snapshotPut(SnapshotBuf* b, const void* p, size_t n) {
+    if (b->len + n > b->cap) {
+        b->cap = (b->cap + n) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+static void snapshotPutU32(SnapshotBuf* b, uint32_t x) { snapshotPut(b, &x, sizeof(x)); }
+static void snapshotPutStr(SnapshotBuf* b, const char* s, size_t n) {
+    snapshotPutU32(b, n);
+    snapshotPut(b, s, n);
+}
+
+typedef struct SnapshotReader {
+    const uint8_t* data;
+    size_t len;
+    size_t pos;
+    bool failed;
+} SnapshotReader;
+static const void* snapshotGet(SnapshotReader* r, size_t n) {
+    if (r->failed || r->len - r->pos < n) { r->failed = true; return NULL; }
+    const void* p = r->data + r->pos;
+    r->pos += n;
+    return p;
+}
+#define SNAPSHOT_GET(r, type, fallback) ({                 \
+            const void* _p = snapshotGet((r), sizeof(type));   \
+            type _x = (fallback);                              \
+            if (_p) { memcpy(&_x, _p, sizeof(type)); }         \
+            _x;                                                \
+        })
+static const char* snapshotGetStr(SnapshotReader* r, uint32_t* outLen) {
+    *outLen = SNAPSHOT_GET(r, uint32_t, 0);
+    return snapshotGet(r, *outLen);
+}
+
+static uint32_t snapshotCrc32(const uint8_t* data, size_t len) {
+    static uint32_t table[256];
+    static _Atomic bool tableReady = false;
+    if (!tableReady) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) { c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1; }
+            table[i] = c;
+        }
+        tableReady = true;
+    }
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+int dbSnapshotWrite(Db* db, const char* path,
+                    DbSnapshotFilterFn filter, void* filterArg) {
+    SnapshotBuf b = { .data = malloc(65536), .len = 0, .cap = 65536 };
+    snapshotPut(&b, DB_SNAPSHOT_MAGIC, strlen(DB_SNAPSHOT_MAGIC));
+    snapshotPutU32(&b, DB_SNAPSHOT_FORMAT_VERSION);
+
+    // Count goes in once we know it.
+    size_t nHoldsPos = b.len; snapshotPutU32(&b, 0);
+    uint32_t nHolds = 0;
+    mutexLock(&db->holdsMutex);
+    for (int i = 0; i < sizeof(db->holds)/sizeof(db->holds[0]); i++) {
+        Hold* hold = &db->holds[i];
+        if (hold->key == NULL) { continue; }
+        Statement* stmt = statementAcquire(db, hold->statement);
+        if (stmt == NULL) { continue; }
+        Clause* clause = statementClause(stmt);
+        if (filter == NULL || filter(filterArg, hold->key, clause)) {
+            snapshotPutStr(&b, hold->key, strlen(hold->key));
+            snapshotPut(&b, &hold->version, sizeof(hold->version));
+            int64_t keepMs = stmt->keepMs;
+            snapshotPut(&b, &keepMs, sizeof(keepMs));
+            snapshotPutStr(&b, stmt->sourceFileName, strlen(stmt->sourceFileName));
+            int32_t sourceLineNumber = stmt->sourceLineNumber;
+            snapshotPut(&b, &sourceLineNumber, sizeof(sourceLineNumber));
+            snapshotPutU32(&b, clause->nTerms);
+            for (int j = 0; j < clause->nTerms; j++) {
+                snapshotPutStr(&b, termPtr(clause->terms[j]), termLen(clause->terms[j]));
+            }
+            nHolds++;
+        }
+        statementRelease(db, stmt);
+    }
+    mutexUnlock(&db->holdsMutex);
+    memcpy(b.data + nHoldsPos, &nHolds, sizeof(nHolds));
+
+    size_t nAtomicallysPos = b.len; snapshotPutU32(&b, 0);
+    uint32_t nAtomicallys = 0;
+    mutexLock(&db->atomicallysMutex);
+    for (int i = 0; i < sizeof(db->atomicallys)/sizeof(db->atomicallys[0]); i++) {
+        Atomically* atomically = &db->atomicallys[i];
+        if (atomically->key == NULL) { continue; }
+        snapshotPutStr(&b, atomically->key, strlen(atomically->key));
+        int32_t nextNumber = atomically->nextNumber;
+        snapshotPut(&b, &nextNumber, sizeof(nextNumber));
+        nAtomicallys++;
+    }
+    mutexUnlock(&db->atomicallysMutex);
+    memcpy(b.data + nAtomicallysPos, &nAtomicallys, sizeof(nAtomicallys));
+
+    snapshotPutU32(&b, snapshotCrc32(b.data, b.len));
+
+    // Write-and-rename, so a crash mid-write leaves the previous
+    // snapshot intact.
+    char tmpPath[PATH_MAX];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE* fp = fopen(tmpPath, "wb");
+    if (fp == NULL) { free(b.data); return -1; }
+    bool ok = fwrite(b.data, 1, b.len, fp) == b.len;
+    ok = fflush(fp) == 0 && ok;
+    ok = fsync(fileno(fp)) == 0 && ok;
+    ok = fclose(fp) == 0 && ok;
+    free(b.data);
+    if (!ok || rename(tmpPath, path) != 0) {
+        unlink(tmpPath);
+        return -1;
+    }
+    return nHolds;
+}
+
+int dbSnapshotLoad(Db* db, const char* path, Statement*** outStmts) {
+    *outStmts = NULL;
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) { return -1; }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t* data = malloc(size > 0 ? size : 1);
+    bool readOk = size >= 0 && fread(data, 1, size, fp) == (size_t) size;
+    fclose(fp);
+
+    size_t headerLen = strlen(DB_SNAPSHOT_MAGIC) + sizeof(uint32_t);
+    uint32_t crc;
+    if (!readOk || (size_t) size < headerLen + sizeof(crc) ||
+        memcmp(data, DB_SNAPSHOT_MAGIC, strlen(DB_SNAPSHOT_MAGIC)) != 0) {
+        fprintf(stderr, "dbSnapshotLoad: %s is not a snapshot\n", path);
+        free(data); errno = EINVAL; return -1;
+    }
+    memcpy(&crc, data + size - sizeof(crc), sizeof(crc));
+    if (crc != snapshotCrc32(data, size - sizeof(crc))) {
+        fprintf(stderr, "dbSnapshotLoad: %s has a bad checksum\n", path);
+        free(data); errno = EINVAL; return -1;
+    }
+    SnapshotReader r = { .data = data, .len = size - sizeof(crc),
+                         .pos = strlen(DB_SNAPSHOT_MAGIC) };
+    uint32_t formatVersion = SNAPSHOT_GET(&r, uint32_t, 0);
+    if (formatVersion != DB_SNAPSHOT_FORMAT_VERSION) {
+        fprintf(stderr, "dbSnapshotLoad: %s has format version %u, expected %u\n",
+                path, formatVersion, DB_SNAPSHOT_FORMAT_VERSION);
+        free(data); errno = EINVAL; return -1;
+    }
+
+    // We hold holdsMutex across the whole load, so no live Hold can
+    // land on a key between our checking it and our installing the
+    // restored statement.
+    mutexLock(&db->holdsMutex);
+
+    // Every hold record gets read (even ones we end up skipping), so
+    // that the Atomically section after them parses from the right
+    // place.
+    uint32_t nHolds = SNAPSHOT_GET(&r, uint32_t, 0);
+    if (nHolds > r.len - r.pos) { r.failed = true; nHolds = 0; }
+    StatementRef* refs = calloc(nHolds + 1, sizeof(StatementRef));
+    Hold** slots = calloc(nHolds + 1, sizeof(Hold*));
+    bool* added = calloc(nHolds + 1, sizeof(bool));
+    Statement** out = calloc(nHolds + 1, sizeof(Statement*));
+    int nLoaded = 0;
+    int nNoSlot = 0;
+    for (uint32_t i = 0; i < nHolds && !r.failed; i++) {
+        uint32_t keyLen; const char* key = snapshotGetStr(&r, &keyLen);
+        SNAPSHOT_GET(&r, double, 0); // version; see below.
+        int64_t keepMs = SNAPSHOT_GET(&r, int64_t, 0);
+        uint32_t sourceFileNameLen;
+        const char* sourceFileName = snapshotGetStr(&r, &sourceFileNameLen);
+        int32_t sourceLineNumber = SNAPSHOT_GET(&r, int32_t, 0);
+        uint32_t nTerms = SNAPSHOT_GET(&r, uint32_t, 0);
+        if (r.failed || nTerms == 0 || nTerms > r.len - r.pos) { r.failed = true; break; }
+        Clause* clause = clauseNew(nTerms);
+        for (uint32_t j = 0; j < nTerms; j++) {
+            uint32_t termLen; const char* term = snapshotGetStr(&r, &termLen);
+            clause->terms[j] = termNew(term ? term : "", term ? termLen : 0);
+        }
+        if (r.failed) { clauseFree(clause); break; }
+
+        char* keyStr = strndup(key, keyLen);
+        char* sourceFileNameStr = strndup(sourceFileName, sourceFileNameLen);
+
+        // A live Hold on the same key wins over the snapshot.
+        Hold* slot = NULL;
+        bool keyIsLive = false;
+        for (int k = 0; k < sizeof(db->holds)/sizeof(db->holds[0]); k++) {
+            if (db->holds[k].key == NULL) {
+                if (slot == NULL) { slot = &db->holds[k]; }
+            } else if (strcmp(db->holds[k].key, keyStr) == 0) {
+                keyIsLive = true; break;
+            }
+        }
+        if (keyIsLive || slot == NULL) {
+            if (!keyIsLive) { nNoSlot++; }
+            clauseFree(clause); free(keyStr); free(sourceFileNameStr);
+            continue;
+        }
+        // Claim the slot now so later records don't reuse it. Restored
+        // Holds come back at version -1, so whatever live source
+        // re-establishes the key (with any version) supersedes them.
+        slot->key = keyStr;
+        slot->version = -1;
+        slot->statement = STATEMENT_REF_NULL;
+
+        refs[nLoaded] = statementNew(db, clause, keepMs, NULL,
+                                     sourceFileNameStr, sourceLineNumber);
+        slots[nLoaded] = slot;
+        nLoaded++;
+        free(sourceFileNameStr);
+    }
+
+    if (nNoSlot > 0) {
+        fprintf(stderr, "dbSnapshotLoad: Ran out of hold slots; skipped %d Holds\n",
+                nNoSlot);
+    }
+
+    // Index the restored statements in batches, each with a single
+    // swap of the trie root, instead of one CAS per statement. Each
+    // trieAdd allocates (and retires) about one node per term, and an
+    // epoch only has room for ~1000 of each, so we size batches by
+    // term count.
+    for (int batchStart = 0; batchStart < nLoaded; ) {
+        int batchEnd = batchStart;
+        int batchTerms = 0;
+        while (batchEnd < nLoaded && (batchEnd == batchStart || batchTerms < 256)) {
+            batchTerms += statementClause(statementUnsafeGet(db, refs[batchEnd]))->nTerms + 1;
+            batchEnd++;
+        }
+
+        epochBegin();
+        const Trie* oldClauseToStatementRef;
+        const Trie* newClauseToStatementRef;
+        int nAdded;
+        do {
+            epochReset();
+            nAdded = 0;
+            oldClauseToStatementRef = db->clauseToStatementRef;
+            newClauseToStatementRef = oldClauseToStatementRef;
+            for (int i = batchStart; i < batchEnd; i++) {
+                Statement* stmt = statementUnsafeGet(db, refs[i]);
+                const Trie* t = trieAdd(newClauseToStatementRef,
+                                        epochAlloc, epochFree,
+                                        statementClause(stmt), refs[i].val);
+                // If trieAdd didn't add anything, the clause is
+                // already in the db (from a live statement or an
+                // earlier record).
+                added[i] = t != newClauseToStatementRef;
+                if (added[i]) { nAdded++; }
+                newClauseToStatementRef = t;
+            }
+        } while (nAdded > 0 &&
+                 !atomic_compare_exchange_weak(&db->clauseToStatementRef,
+                                               &oldClauseToStatementRef,
+                                               newClauseToStatementRef));
+        epochEnd();
+        indexedStatements += nAdded;
+
+        batchStart = batchEnd;
+    }
+
+    int nOut = 0;
+    for (int i = 0; i < nLoaded; i++) {
+        Statement* stmt = statementAcquire(db, refs[i]);
+        if (added[i]) {
+            slots[i]->statement = refs[i];
+            out[nOut++] = stmt;
+        } else {
+            free((char*) slots[i]->key);
+            slots[i]->key = NULL;
+            stmt->parentCount = 0;
+            statementRemoveSelf(db, stmt, false);
+            statementRelease(db, stmt);
+        }
+    }
+    mutexUnlock(&db->holdsMutex);
+
+    // Restore Atomically numbering so version numbers keep climbing
+    // across the restart.
+    uint32_t nAtomicallys = SNAPSHOT_GET(&r, uint32_t, 0);
+    mutexLock(&db->atomicallysMutex);
+    for (uint32_t i = 0; i < nAtomicallys && !r.failed; i++) {
+        uint32_t keyLen; const char* key = snapshotGetStr(&r, &keyLen);
+        int32_t nextNumber = SNAPSHOT_GET(&r, int32_t, 0);
+        if (r.failed) { break; }
+
+        Atomically* slot = NULL;
+        for (unsigned long k = 0; k < sizeof(db->atomicallys)/sizeof(db->atomicallys[0]); k++) {
+            const char* existingKey = db->atomicallys[k].key;
+            if (existingKey == NULL) {
+                if (slot == NULL) { slot = &db->atomicallys[k]; }
+            } else if (strlen(existingKey) == keyLen &&
+                       memcmp(existingKey, key, keyLen) == 0) {
+                if (db->atomicallys[k].nextNumber < nextNumber) {
+                    db->atomicallys[k].nextNumber = nextNumber;
+                }
+                slot = NULL; break;
+            }
+        }
+        if (slot != NULL) {
+            slot->key = strndup(key, keyLen);
+            slot->nextNumber = nextNumber;
+            slot->allVersions = NULL;
+            slot->timeout = 100000000; // 100ms
+            slot->latestConvergedTime = 0;
+            slot->latestConvergedNumber = -1;
+        }
+    }
+    mutexUnlock(&db->atomicallysMutex);
+
+    if (r.failed) {
+        fprintf(stderr, "dbSnapshotLoad: %s is truncated; loaded what we could\n", path);
+    }
+    free(refs); free(slots); free(added);
+    free(data);
+    *outStmts = out;
+    return nOut;
+}
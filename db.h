@@ -97,6 +97,21 @@ typedef struct Clause Clause;
 Db* dbNew();
 const Trie* dbGetClauseToStatementRef(Db* db);
 
+// Running totals, read without touching the trie. Alive counts are
+// created minus destroyed; indexedStatements is the number of
+// statements in the trie.
+typedef struct DbMetrics {
+    int64_t statementsCreated;
+    int64_t statementsDestroyed;
+    int64_t matchesCreated;
+    int64_t matchesDestroyed;
+    int64_t indexedStatements;
+    int64_t destructorsRun;
+    int64_t atomicallyVersionsCreated;
+    int64_t atomicallyVersionsDestroyed;
+} DbMetrics;
+void dbGetMetrics(Db* db, DbMetrics* out);
+
 typedef struct ResultSet {
     size_t nResults;
     StatementRef results[];
@@ -109,13 +124,23 @@ typedef struct ResultSet {
 // Caller must free the returned ResultSet*.
 ResultSet* dbQuery(Db* db, Clause* pattern);
 
+// Like dbQuery, but calls `visit` with each matching StatementRef
+// instead of collecting them, so there's no limit on how many
+// statements can match. `visit` runs inside an epoch, so it must not
+// block or acquire statements; copy out the refs it wants to keep.
+void dbQueryVisit(Db* db, Clause* pattern,
+                  void (*visit)(StatementRef ref, void* arg), void* arg);
+
 // Creates and returns a new version (convergence-tracking subgraph)
 // on `key`.
 //
 // Copies `key` if needed (so the caller may safely free it
 // afterward). The returned pointer can be passed to Match and
 // Statement insertion to attach them to that version. The
-// AtomicallyVersion is guaranteed not to ever be freed.
+// AtomicallyVersion is refcounted: it's freed once it's been reaped
+// (superseded by a newer converged version, or timed out) and no
+// Statement or Match refers to it anymore. Don't hang onto it past
+// the Match or Statement you got it from.
 AtomicallyVersion* dbFreshAtomicallyVersionOnKey(Db* db, const char* key,
                                                  MatchRef rootMatchRef);
 
@@ -174,4 +199,33 @@ Statement* dbHoldStatement(Db* db,
                            const char* sourceFileName, int sourceLineNumber,
                            StatementRef* outOldStatement);
 
+// Snapshot
+// --------
+
+// A snapshot is the durable part of the DB: every Hold (its key,
+// version, clause, keepMs, and source location) and the next version
+// number of every Atomically. It lets Folk restart into a populated
+// state and let live sources re-establish themselves from there.
+
+// Return false from the filter to leave a Hold out of the snapshot.
+typedef bool (*DbSnapshotFilterFn)(void* arg, const char* holdKey, Clause* clause);
+
+// Writes a snapshot to `path` (atomically, via a rename). `filter`
+// may be NULL. Returns the number of Holds written, or -1 (with
+// errno set) on failure.
+int dbSnapshotWrite(Db* db, const char* path,
+                    DbSnapshotFilterFn filter, void* filterArg);
+
+// Restores the Holds from the snapshot at `path`, skipping any whose
+// key is already held (live Holds win) or whose clause is already in
+// the db. Restored Holds come back at version -1, so any new Hold on
+// the same key supersedes them. All restored statements are indexed
+// in one batch.
+//
+// Sets `*outStmts` to a malloc'd array of the newly-created
+// statements, returned acquired: the caller should react to them,
+// release them, and then free the array. Returns how many, or -1 on
+// failure.
+int dbSnapshotLoad(Db* db, const char* path, Statement*** outStmts);
+
 #endif
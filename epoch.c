@@ -178,6 +178,14 @@ void epochEnd() {
 #endif
 }
 
+int epochGarbageBacklog() {
+    int backlog = 0;
+    for (int i = 0; i < 3; i++) {
+        backlog += epochGlobalGarbage[i].garbageNextIdx;
+    }
+    return backlog;
+}
+
 // This should be called from just one thread ever.
 void epochGlobalCollect() {
     for (int i = 0; i < EPOCH_THREADS_MAX; i++) {
@@ -14,6 +14,10 @@ void epochBegin();
 // thread.
 void epochGlobalCollect();
 
+// Number of retired pointers waiting for epochGlobalCollect to free
+// them.
+int epochGarbageBacklog();
+
 // You should only do the below while in an epoch:
 
 // Reversible operations:
@@ -9,6 +9,8 @@
 #include <inttypes.h>
 #include <signal.h>
 #include <setjmp.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #if __has_include ("tracy/TracyC.h")
 #include "tracy/TracyC.h"
@@ -26,6 +28,10 @@
 
 ThreadControlBlock threads[THREADS_MAX];
 int _Atomic threadCount;
+
+MetricCounter metricCounters[METRIC_COUNTERS_MAX];
+int _Atomic metricCountersCount;
+static pthread_mutex_t metricCountersMutex = PTHREAD_MUTEX_INITIALIZER;
 __thread ThreadControlBlock* self;
 // helper function to get self from LLDB:
 ThreadControlBlock* getSelf() { return self; }
@@ -555,6 +561,73 @@ static int __currentMatchRefFunc(Jim_Interp *interp, int argc, Jim_Obj *const *a
     Jim_SetResultString(interp, ret, strlen(ret));
     return JIM_OK;
 }
+// Returns {ref terms} for the statement that the currently running
+// When body matched, or an empty string outside of a When body.
+static int __currentMatchStatementFunc(Jim_Interp *interp, int argc, Jim_Obj *const *argv) {
+    assert(argc == 1);
+    StatementRef stmtRef = STATEMENT_REF_NULL;
+    mutexLock(&self->currentItemMutex);
+    if (self->currentItem.op == RUN_WHEN) {
+        stmtRef = self->currentItem.runWhen.stmt;
+    }
+    mutexUnlock(&self->currentItemMutex);
+
+    Statement* stmt = statementRefIsNull(stmtRef) ? NULL : statementAcquire(db, stmtRef);
+    if (stmt == NULL) {
+        Jim_SetEmptyResult(interp);
+        return JIM_OK;
+    }
+
+    char ref[100]; snprintf(ref, 100, "s%d:%d", stmtRef.idx, stmtRef.gen);
+    Clause* clause = statementClause(stmt);
+    Jim_Obj* objv[] = {
+        Jim_NewStringObj(interp, ref, -1),
+        termsToJimObj(interp, clause->nTerms, clause->terms)
+    };
+    statementRelease(db, stmt);
+
+    Jim_SetResult(interp, Jim_NewListObj(interp, objv, 2));
+    return JIM_OK;
+}
+typedef struct StatementRefs {
+    StatementRef* refs;
+    size_t nRefs;
+    size_t capRefs;
+} StatementRefs;
+static void statementRefsAppend(StatementRef ref, void* arg) {
+    StatementRefs* refs = arg;
+    if (refs->nRefs == refs->capRefs) {
+        refs->capRefs = refs->capRefs * 2 + 64;
+        refs->refs = realloc(refs->refs, refs->capRefs * sizeof(StatementRef));
+    }
+    refs->refs[refs->nRefs++] = ref;
+}
+// Returns a flat list of ref and terms for every statement that
+// matches the pattern (for snapshots of statement deltas; see
+// web.folk). Unlike Query!, doesn't give up on broad patterns.
+static int __queryStatementsFunc(Jim_Interp *interp, int argc, Jim_Obj *const *argv) {
+    assert(argc == 2);
+    Clause* pattern = jimObjToClause(interp, argv[1]);
+    StatementRefs rs = {0};
+    dbQueryVisit(db, pattern, statementRefsAppend, &rs);
+    clauseFree(pattern);
+
+    Jim_Obj* ret = Jim_NewListObj(interp, NULL, 0);
+    for (size_t i = 0; i < rs.nRefs; i++) {
+        Statement* stmt = statementAcquire(db, rs.refs[i]);
+        if (stmt == NULL) { continue; }
+
+        char ref[100]; snprintf(ref, 100, "s%d:%d", rs.refs[i].idx, rs.refs[i].gen);
+        Clause* clause = statementClause(stmt);
+        Jim_ListAppendElement(interp, ret, Jim_NewStringObj(interp, ref, -1));
+        Jim_ListAppendElement(interp, ret, termsToJimObj(interp, clause->nTerms, clause->terms));
+        statementRelease(db, stmt);
+    }
+    free(rs.refs);
+
+    Jim_SetResult(interp, ret);
+    return JIM_OK;
+}
 static int __isWhenOfCurrentMatchAlreadyRunningFunc(Jim_Interp *interp, int argc, Jim_Obj *const *argv) {
     assert(argc == 1);
     StatementRef whenRef = STATEMENT_REF_NULL;
@@ -583,6 +656,237 @@ static int __isInSubscriptionFunc(Jim_Interp *interp, int argc, Jim_Obj *const *
     Jim_SetResultBool(interp, self->inSubscription);
     return JIM_OK;
 }
+static MetricCounter* metricCounterFind(const char* name) {
+    int n = metricCountersCount;
+    for (int i = 0; i < n; i++) {
+        if (strcmp(metricCounters[i].name, name) == 0) { return &metricCounters[i]; }
+    }
+    return NULL;
+}
+static MetricCounter* metricCounterFindOrCreate(const char* name, bool isGauge) {
+    MetricCounter* counter = metricCounterFind(name);
+    if (counter == NULL) {
+        pthread_mutex_lock(&metricCountersMutex);
+        counter = metricCounterFind(name);
+        if (counter == NULL && metricCountersCount < METRIC_COUNTERS_MAX) {
+            counter = &metricCounters[metricCountersCount];
+            snprintf(counter->name, sizeof(counter->name), "%s", name);
+            counter->isGauge = isGauge;
+            metricCountersCount++;
+        }
+        pthread_mutex_unlock(&metricCountersMutex);
+    }
+    return counter;
+}
+// __metricIncr name ?by?: bumps the named counter, creating it on
+// first use.
+static int __metricIncrFunc(Jim_Interp *interp, int argc, Jim_Obj *const *argv) {
+    if (argc != 2 && argc != 3) {
+        Jim_WrongNumArgs(interp, 1, argv, "name ?by?");
+        return JIM_ERR;
+    }
+    long by = 1;
+    if (argc == 3 && Jim_GetLong(interp, argv[2], &by) != JIM_OK) {
+        return JIM_ERR;
+    }
+    MetricCounter* counter = metricCounterFindOrCreate(Jim_String(argv[1]), false);
+    if (counter == NULL) {
+        Jim_SetResultString(interp, "__metricIncr: Too many counters", -1);
+        return JIM_ERR;
+    }
+    counter->value += by;
+    return JIM_OK;
+}
+// __metricSet name value: sets the named gauge, creating it on first
+// use.
+static int __metricSetFunc(Jim_Interp *interp, int argc, Jim_Obj *const *argv) {
+    if (argc != 3) {
+        Jim_WrongNumArgs(interp, 1, argv, "name value");
+        return JIM_ERR;
+    }
+    long value;
+    if (Jim_GetLong(interp, argv[2], &value) != JIM_OK) {
+        return JIM_ERR;
+    }
+    MetricCounter* counter = metricCounterFindOrCreate(Jim_String(argv[1]), true);
+    if (counter == NULL) {
+        Jim_SetResultString(interp, "__metricSet: Too many counters", -1);
+        return JIM_ERR;
+    }
+    counter->value = value;
+    return JIM_OK;
+}
+
+// Boot program loading:
+
+typedef struct ReadFilesJob {
+    int nPaths;
+    const char** paths;
+    char** contents;
+    size_t* lens;
+    int _Atomic nextPath;
+} ReadFilesJob;
+static void* readFilesWorker(void* arg) {
+    ReadFilesJob* job = arg;
+    int i;
+    while ((i = job->nextPath++) < job->nPaths) {
+        int fd = open(job->paths[i], O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0) { continue; }
+        if (fstat(fd, &st) < 0) { close(fd); continue; }
+        char* buf = malloc(st.st_size + 1);
+        if (buf == NULL) { close(fd); continue; }
+        size_t len = 0;
+        ssize_t n = 0;
+        while (len < (size_t) st.st_size &&
+               ((n = read(fd, buf + len, st.st_size - len)) > 0 ||
+                (n < 0 && errno == EINTR))) {
+            if (n > 0) { len += n; }
+        }
+        close(fd);
+        // A short read means the file changed or failed under us, so
+        // leave it out rather than boot a truncated program.
+        if (len < (size_t) st.st_size) { free(buf); continue; }
+        buf[len] = '\0';
+        job->contents[i] = buf;
+        job->lens[i] = len;
+    }
+    return NULL;
+}
+// __readFiles paths: reads all the files at once, on a few threads,
+// and returns a dict from path to contents. Files that can't be read
+// are left out.
+static int __readFilesFunc(Jim_Interp *interp, int argc, Jim_Obj *const *argv) {
+    if (argc != 2) {
+        Jim_WrongNumArgs(interp, 1, argv, "paths");
+        return JIM_ERR;
+    }
+    int nPaths = Jim_ListLength(interp, argv[1]);
+    ReadFilesJob job = {
+        .nPaths = nPaths,
+        .paths = calloc(nPaths + 1, sizeof(char*)),
+        .contents = calloc(nPaths + 1, sizeof(char*)),
+        .lens = calloc(nPaths + 1, sizeof(size_t)),
+        .nextPath = 0
+    };
+    for (int i = 0; i < nPaths; i++) {
+        job.paths[i] = Jim_String(Jim_ListGetIndex(interp, argv[1], i));
+    }
+
+    pthread_t readers[8];
+    int nReaders = nPaths < 8 ? nPaths : 8;
+    for (int i = 0; i < nReaders; i++) {
+        pthread_create(&readers[i], NULL, readFilesWorker, &job);
+    }
+    for (int i = 0; i < nReaders; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    Jim_Obj* ret = Jim_NewDictObj(interp, NULL, 0);
+    for (int i = 0; i < nPaths; i++) {
+        if (job.contents[i] == NULL) { continue; }
+        Jim_DictAddElement(interp, ret, Jim_ListGetIndex(interp, argv[1], i),
+                           Jim_NewStringObjNoAlloc(interp, job.contents[i], job.lens[i]));
+    }
+    free(job.paths); free(job.contents); free(job.lens);
+    Jim_SetResult(interp, ret);
+    return JIM_OK;
+}
+
+#define PROGRAM_FINGERPRINTS_MAX 4096
+static struct { char* path; uint64_t hash; } programFingerprints[PROGRAM_FINGERPRINTS_MAX];
+static int programFingerprintsCount = 0;
+static pthread_mutex_t programFingerprintsMutex = PTHREAD_MUTEX_INITIALIZER;
+// __programCodeChanged path code: returns false if `code` is what
+// `path` had last time we were asked (by boot or by a file watcher),
+// so that unchanged programs don't get reloaded.
+static int __programCodeChangedFunc(Jim_Interp *interp, int argc, Jim_Obj *const *argv) {
+    if (argc != 3) {
+        Jim_WrongNumArgs(interp, 1, argv, "path code");
+        return JIM_ERR;
+    }
+    const char* path = Jim_String(argv[1]);
+    int codeLen; const char* code = Jim_GetString(argv[2], &codeLen);
+    // FNV-1a.
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < codeLen; i++) {
+        hash = (hash ^ (uint8_t) code[i]) * 1099511628211ULL;
+    }
+
+    bool changed = true;
+    pthread_mutex_lock(&programFingerprintsMutex);
+    int i;
+    for (i = 0; i < programFingerprintsCount; i++) {
+        if (strcmp(programFingerprints[i].path, path) == 0) { break; }
+    }
+    if (i < programFingerprintsCount) {
+        changed = programFingerprints[i].hash != hash;
+        programFingerprints[i].hash = hash;
+    } else if (i < PROGRAM_FINGERPRINTS_MAX) {
+        programFingerprints[i].path = strdup(path);
+        programFingerprints[i].hash = hash;
+        programFingerprintsCount++;
+    }
+    pthread_mutex_unlock(&programFingerprintsMutex);
+
+    Jim_SetResultBool(interp, changed);
+    return JIM_OK;
+}
+
+// DB snapshots (see dbSnapshotWrite in db.c):
+
+// Leaves out Holds that point at things that only exist in this
+// process (C pointers, Jim references, C libraries), since they'd be
+// dangling after a restart.
+static bool snapshotHoldIsDurable(void* arg, const char* holdKey, Clause* clause) {
+    for (int i = 0; i < clause->nTerms; i++) {
+        int len = termLen(clause->terms[i]);
+        const char* s = termPtr(clause->terms[i]);
+        if (memmem(s, len, ") 0x", 4) || memmem(s, len, "<reference.<", 12) ||
+            memmem(s, len, "<C:", 3)) {
+            return false;
+        }
+    }
+    return true;
+}
+// __dbSnapshotWrite path: returns the number of Holds written.
+static int __dbSnapshotWriteFunc(Jim_Interp *interp, int argc, Jim_Obj *const *argv) {
+    if (argc != 2) {
+        Jim_WrongNumArgs(interp, 1, argv, "path");
+        return JIM_ERR;
+    }
+    int n = dbSnapshotWrite(db, Jim_String(argv[1]), snapshotHoldIsDurable, NULL);
+    if (n < 0) {
+        Jim_SetResultFormatted(interp, "__dbSnapshotWrite: %s", strerror(errno));
+        return JIM_ERR;
+    }
+    Jim_SetResultInt(interp, n);
+    return JIM_OK;
+}
+// __dbSnapshotLoad path: restores the Holds from a snapshot and
+// reacts to them. Returns the number of Holds restored.
+static int __dbSnapshotLoadFunc(Jim_Interp *interp, int argc, Jim_Obj *const *argv) {
+    if (argc != 2) {
+        Jim_WrongNumArgs(interp, 1, argv, "path");
+        return JIM_ERR;
+    }
+    Statement** stmts;
+    int n = dbSnapshotLoad(db, Jim_String(argv[1]), &stmts);
+    if (n < 0) {
+        Jim_SetResultFormatted(interp, "__dbSnapshotLoad: could not load %#s",
+                               argv[1]);
+        return JIM_ERR;
+    }
+    for (int i = 0; i < n; i++) {
+        reactToNewStatement(statementRef(db, stmts[i]));
+        dbInflightDecr(db, stmts[i]);
+        statementRelease(db, stmts[i]);
+    }
+    free(stmts);
+    Jim_SetResultInt(interp, n);
+    return JIM_OK;
+}
+
 static int __isTracyEnabledFunc(Jim_Interp *interp, int argc, Jim_Obj *const *argv) {
 #ifdef TRACY_ENABLE
     Jim_SetResultBool(interp, true);
@@ -672,11 +976,21 @@ static void interpBoot() {
     Jim_CreateCommand(interp, "__variableNameIsNonCapturing", __variableNameIsNonCapturingFunc, NULL, NULL);
     Jim_CreateCommand(interp, "__startsWithDollarSign", __startsWithDollarSignFunc, NULL, NULL);
     Jim_CreateCommand(interp, "__currentMatchRef", __currentMatchRefFunc, NULL, NULL);
+    Jim_CreateCommand(interp, "__currentMatchStatement", __currentMatchStatementFunc, NULL, NULL);
+    Jim_CreateCommand(interp, "__queryStatements", __queryStatementsFunc, NULL, NULL);
     Jim_CreateCommand(interp, "__isWhenOfCurrentMatchAlreadyRunning", __isWhenOfCurrentMatchAlreadyRunningFunc, NULL, NULL);
     Jim_CreateCommand(interp, "__isInSubscription", __isInSubscriptionFunc, NULL, NULL);
 
+    Jim_CreateCommand(interp, "__metricIncr", __metricIncrFunc, NULL, NULL);
+    Jim_CreateCommand(interp, "__metricSet", __metricSetFunc, NULL, NULL);
     Jim_CreateCommand(interp, "__isTracyEnabled", __isTracyEnabledFunc, NULL, NULL);
 
+    Jim_CreateCommand(interp, "__readFiles", __readFilesFunc, NULL, NULL);
+    Jim_CreateCommand(interp, "__programCodeChanged", __programCodeChangedFunc, NULL, NULL);
+
+    Jim_CreateCommand(interp, "__dbSnapshotWrite", __dbSnapshotWriteFunc, NULL, NULL);
+    Jim_CreateCommand(interp, "__dbSnapshotLoad", __dbSnapshotLoadFunc, NULL, NULL);
+
     Jim_CreateCommand(interp, "__db", __dbFunc, NULL, NULL);
     Jim_CreateCommand(interp, "__threadId", __threadIdFunc, NULL, NULL);
 
@@ -854,6 +1168,7 @@ static void runWhenBlock(StatementRef whenRef, Clause* whenPattern, StatementRef
         if (self->currentAtomicallyVersion != NULL) {
             dbAtomicallyVersionInflightDecr(db, self->currentAtomicallyVersion);
         }
+        self->currentAtomicallyVersion = NULL;
 
         statementRelease(db, when);
         if (stmt != NULL) {
@@ -886,6 +1201,8 @@ static void runWhenBlock(StatementRef whenRef, Clause* whenPattern, StatementRef
     matchCompleted(self->currentMatch);
     matchRelease(db, self->currentMatch);
     self->currentMatch = NULL;
+    // The match was what kept the version alive for us.
+    self->currentAtomicallyVersion = NULL;
 
     if (error == JIM_ERR) {
         Jim_MakeErrorMessage(interp);
@@ -915,6 +1232,7 @@ static void runSubscribeBlock(StatementRef subscribeRef, Clause* subscribePatter
     assert(subscribeClause->nTerms >= 5);
 
     self->currentMatch = NULL;
+    self->currentAtomicallyVersion = NULL;
     self->inSubscription = true;
 
     // key x was pressed
@@ -1306,6 +1624,8 @@ void workerRun(WorkQueueItem item) {
         exit(1);
     }
 
+    self->busyNs += timestamp_get(self->clockid) - self->currentItemStartTimestamp;
+    self->itemsRun++;
     self->currentItemStartTimestamp = 0;
     mutexLock(&self->currentItemMutex);
     self->currentItem = (WorkQueueItem) { .op = NONE };
@@ -1381,7 +1701,9 @@ WorkQueueItem workerSteal() {
         return (WorkQueueItem) { .op = NONE };
     }
 
-    return workQueueSteal(threads[stealee].workQueue);
+    WorkQueueItem item = workQueueSteal(threads[stealee].workQueue);
+    if (item.op != NONE) { self->steals++; }
+    return item;
 }
 void workerLoop() {
     int64_t schedtick = 0;
@@ -0,0 +1,386 @@
+# audio.tcl --
+#
+#     A small sample player on top of a raw miniaudio device. Sound
+#     files are decoded once, at the device's format, into a bank of
+#     shared PCM buffers. Playing a sound just sends a command through
+#     a lock-free queue to the audio thread, which mixes a fixed pool
+#     of voices (stealing the oldest one when they're all busy) and
+#     starts each voice on the exact frame it was scheduled for.
+#
+#     Requires ALSA, PulseAudio, or JACK drivers (or the null backend,
+#     which plays into nothing in real time, for tests).
+#
+#     See https://miniaud.io/. We are using Miniaudio v0.11.23.
+
+set cc [C]
+$cc cflags -I./vendor/miniaudio
+
+if {![catch {exec which sclang}]} {
+    # HACK: We're running msuic.folk and therefore are running JACK,
+    # so we should force miniaudio to not use ALSA directly (because
+    # that won't work).
+    $cc code {
+        #define MA_NO_ALSA
+        #define MA_NO_PULSEAUDIO
+    }
+}
+$cc code {
+   #define MINIAUDIO_IMPLEMENTATION
+}
+
+$cc include <pthread.h>
+$cc include <stdatomic.h>
+$cc include <stdio.h>
+$cc include <stdint.h>
+$cc include <stdlib.h>
+$cc include <string.h>
+$cc include <time.h>
+$cc include <miniaudio.h>
+
+if {$::tcl_platform(os) ne "Darwin"} {
+    $cc endcflags -lpthread -lm -ldl
+}
+
+$cc code {
+    #define AUDIO_CHANNELS 2
+    #define AUDIO_MAX_SAMPLES 256
+    #define AUDIO_MAX_VOICES 32
+    // Must be a power of 2.
+    #define AUDIO_QUEUE_SIZE 1024
+
+    // A decoded sound file. Never freed once it's in the bank, so the
+    // audio thread can keep reading it without any locking.
+    typedef struct Sample {
+        char* path;
+        float* frames; // interleaved, AUDIO_CHANNELS per frame
+        uint64_t frameCount;
+    } Sample;
+
+    static Sample* _Atomic bank[AUDIO_MAX_SAMPLES];
+    static int _Atomic bankCount;
+    static pthread_mutex_t bankMutex = PTHREAD_MUTEX_INITIALIZER;
+
+    typedef enum { AUDIO_PLAY, AUDIO_STOP } AudioCommandType;
+    typedef struct AudioCommand {
+        AudioCommandType type;
+        int voiceId;
+        int sample;
+        uint64_t startFrame; // 0 means as soon as possible
+        float gain;
+        bool loop;
+        int64_t sentNs;
+    } AudioCommand;
+
+    // Bounded multi-producer queue (after Dmitry Vyukov's): any
+    // thread can send, only the audio thread receives, and neither
+    // side ever blocks.
+    typedef struct AudioCommandCell {
+        size_t _Atomic seq;
+        AudioCommand command;
+    } AudioCommandCell;
+    static AudioCommandCell queue[AUDIO_QUEUE_SIZE];
+    static size_t _Atomic queueSendPos;
+    static size_t queueReceivePos;
+
+    static bool commandSend(AudioCommand* command) {
+        size_t pos = atomic_load_explicit(&queueSendPos, memory_order_relaxed);
+        AudioCommandCell* cell;
+        for (;;) {
+            cell = &queue[pos & (AUDIO_QUEUE_SIZE - 1)];
+            size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (atomic_compare_exchange_weak_explicit(&queueSendPos, &pos, pos + 1,
+                                                          memory_order_relaxed,
+                                                          memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = atomic_load_explicit(&queueSendPos, memory_order_relaxed);
+            }
+        }
+        cell->command = *command;
+        atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+        return true;
+    }
+    static bool commandReceive(AudioCommand* command) {
+        AudioCommandCell* cell = &queue[queueReceivePos & (AUDIO_QUEUE_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        if (seq != queueReceivePos + 1) { return false; }
+        *command = cell->command;
+        atomic_store_explicit(&cell->seq, queueReceivePos + AUDIO_QUEUE_SIZE,
+                              memory_order_release);
+        queueReceivePos++;
+        return true;
+    }
+
+    // Only touched by the audio thread.
+    typedef struct Voice {
+        bool active;
+        int id;
+        Sample* sample;
+        uint64_t startFrame;
+        uint64_t cursor;
+        float gain;
+        bool loop;
+        int64_t sentNs;
+        bool started;
+    } Voice;
+    static Voice voices[AUDIO_MAX_VOICES];
+
+    static ma_context context;
+    static ma_device device;
+    static bool deviceInitialized = false;
+    static pthread_mutex_t deviceMutex = PTHREAD_MUTEX_INITIALIZER;
+    static uint32_t sampleRate;
+
+    // Frames the audio thread has mixed so far: the audio clock.
+    static uint64_t _Atomic frameClock;
+    static int _Atomic nextVoiceId = 1;
+
+    static uint64_t _Atomic statsStarted;
+    static uint64_t _Atomic statsStolen;
+    static uint64_t _Atomic statsDropped;
+    static int64_t _Atomic statsLatencySumNs;
+    static int64_t _Atomic statsLatencyMaxNs;
+    static uint64_t _Atomic statsLastStartFrame;
+
+    static int64_t nowNs(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    // Free voice if there is one. Otherwise steal the voice that has
+    // been playing longest, preferring one-shots over loops.
+    static Voice* voiceAllocate(void) {
+        Voice* oldest = NULL; Voice* oldestOneShot = NULL;
+        for (int i = 0; i < AUDIO_MAX_VOICES; i++) {
+            Voice* v = &voices[i];
+            if (!v->active) { return v; }
+            if (oldest == NULL || v->startFrame < oldest->startFrame) { oldest = v; }
+            if (!v->loop && (oldestOneShot == NULL ||
+                             v->startFrame < oldestOneShot->startFrame)) {
+                oldestOneShot = v;
+            }
+        }
+        atomic_fetch_add(&statsStolen, 1);
+        return oldestOneShot != NULL ? oldestOneShot : oldest;
+    }
+
+    static void audioCallback(ma_device* pDevice, void* pOutput,
+                              const void* pInput, ma_uint32 frameCount) {
+        (void) pDevice; (void) pInput;
+        int64_t callbackNs = nowNs();
+        uint64_t blockStart = atomic_load(&frameClock);
+
+        AudioCommand command;
+        while (commandReceive(&command)) {
+            if (command.type == AUDIO_PLAY) {
+                Voice* v = voiceAllocate();
+                *v = (Voice) {
+                    .active = true, .id = command.voiceId,
+                    .sample = atomic_load(&bank[command.sample]),
+                    .startFrame = command.startFrame > blockStart ?
+                        command.startFrame : blockStart,
+                    .cursor = 0, .gain = command.gain, .loop = command.loop,
+                    .sentNs = command.sentNs, .started = false
+                };
+            } else if (command.type == AUDIO_STOP) {
+                for (int i = 0; i < AUDIO_MAX_VOICES; i++) {
+                    if (voices[i].active && voices[i].id == command.voiceId) {
+                        voices[i].active = false;
+                    }
+                }
+            }
+        }
+
+        float* out = (float*) pOutput;
+        memset(out, 0, sizeof(float) * frameCount * AUDIO_CHANNELS);
+        for (int i = 0; i < AUDIO_MAX_VOICES; i++) {
+            Voice* v = &voices[i];
+            if (!v->active || v->startFrame >= blockStart + frameCount) { continue; }
+
+            uint64_t offset = v->startFrame > blockStart ? v->startFrame - blockStart : 0;
+            if (!v->started) {
+                v->started = true;
+                atomic_store(&statsLastStartFrame, v->startFrame);
+            }
+            if (v->sentNs != 0) {
+                // Only as-soon-as-possible plays count toward latency.
+                int64_t latencyNs = callbackNs - v->sentNs +
+                    (int64_t) (offset * 1000000000 / sampleRate);
+                atomic_fetch_add(&statsStarted, 1);
+                atomic_fetch_add(&statsLatencySumNs, latencyNs);
+                if (latencyNs > atomic_load(&statsLatencyMaxNs)) {
+                    atomic_store(&statsLatencyMaxNs, latencyNs);
+                }
+                v->sentNs = 0;
+            }
+
+            Sample* s = v->sample;
+            for (uint64_t f = offset; f < frameCount && v->active; ) {
+                uint64_t n = s->frameCount - v->cursor;
+                if (n > frameCount - f) { n = frameCount - f; }
+                const float* in = &s->frames[v->cursor * AUDIO_CHANNELS];
+                float* o = &out[f * AUDIO_CHANNELS];
+                for (uint64_t k = 0; k < n * AUDIO_CHANNELS; k++) {
+                    o[k] += in[k] * v->gain;
+                }
+                f += n;
+                v->cursor += n;
+                if (v->cursor >= s->frameCount) {
+                    if (v->loop && s->frameCount > 0) { v->cursor = 0; }
+                    else { v->active = false; }
+                }
+            }
+        }
+
+        atomic_store(&frameClock, blockStart + frameCount);
+    }
+}
+
+# Starts the audio device. `backend` is "" for miniaudio's default
+# choice of backend, or "null" for a device that plays into nothing
+# (in real time), for testing. Returns the backend's name.
+$cc proc audioInit {char* backend} char* {
+    pthread_mutex_lock(&deviceMutex);
+    if (deviceInitialized) {
+        pthread_mutex_unlock(&deviceMutex);
+        return (char*) ma_get_backend_name(context.backend);
+    }
+    for (size_t i = 0; i < AUDIO_QUEUE_SIZE; i++) {
+        atomic_store(&queue[i].seq, i);
+    }
+
+    ma_backend nullBackend[] = { ma_backend_null };
+    bool useNull = strcmp(backend, "null") == 0;
+    ma_result r = ma_context_init(useNull ? nullBackend : NULL, useNull ? 1 : 0,
+                                  NULL, &context);
+    if (r != MA_SUCCESS) {
+        pthread_mutex_unlock(&deviceMutex);
+        FOLK_ERROR("miniaudio: context init failed: %s (%d)\n",
+                   ma_result_description(r), (int) r);
+    }
+
+    ma_device_config config = ma_device_config_init(ma_device_type_playback);
+    config.playback.format = ma_format_f32;
+    config.playback.channels = AUDIO_CHANNELS;
+    config.sampleRate = 48000;
+    config.periodSizeInFrames = 256;
+    config.dataCallback = audioCallback;
+    r = ma_device_init(&context, &config, &device);
+    if (r == MA_SUCCESS) {
+        r = ma_device_start(&device);
+        if (r != MA_SUCCESS) { ma_device_uninit(&device); }
+    }
+    if (r != MA_SUCCESS) {
+        ma_context_uninit(&context);
+        pthread_mutex_unlock(&deviceMutex);
+        FOLK_ERROR("miniaudio: device start failed: %s (%d)\n",
+                   ma_result_description(r), (int) r);
+    }
+    sampleRate = device.sampleRate;
+    deviceInitialized = true;
+    pthread_mutex_unlock(&deviceMutex);
+
+    fprintf(stderr, "miniaudio: device started with %s backend\n",
+            ma_get_backend_name(context.backend));
+    return (char*) ma_get_backend_name(context.backend);
+}
+
+# Decodes the sound file at `path` into the bank (once; later loads of
+# the same path are free) and returns its index in the bank.
+$cc proc audioLoad {char* path} int {
+    if (!deviceInitialized) { FOLK_ERROR("audioLoad: Audio isn't initialized\n"); }
+    int n = atomic_load(&bankCount);
+    for (int i = 0; i < n; i++) {
+        if (strcmp(atomic_load(&bank[i])->path, path) == 0) { return i; }
+    }
+
+    pthread_mutex_lock(&bankMutex);
+    n = atomic_load(&bankCount);
+    for (int i = 0; i < n; i++) {
+        if (strcmp(atomic_load(&bank[i])->path, path) == 0) {
+            pthread_mutex_unlock(&bankMutex);
+            return i;
+        }
+    }
+    if (n >= AUDIO_MAX_SAMPLES) {
+        pthread_mutex_unlock(&bankMutex);
+        FOLK_ERROR("audioLoad: Sound bank is full\n");
+    }
+
+    ma_decoder_config config = ma_decoder_config_init(ma_format_f32, AUDIO_CHANNELS, sampleRate);
+    ma_uint64 frameCount; void* frames;
+    ma_result r = ma_decode_file(path, &config, &frameCount, &frames);
+    if (r != MA_SUCCESS) {
+        pthread_mutex_unlock(&bankMutex);
+        FOLK_ERROR("audioLoad: Decoding %s failed: %s (%d)\n",
+                   path, ma_result_description(r), (int) r);
+    }
+
+    Sample* s = malloc(sizeof(Sample));
+    *s = (Sample) { .path = strdup(path), .frames = frames, .frameCount = frameCount };
+    atomic_store(&bank[n], s);
+    atomic_store(&bankCount, n + 1);
+    pthread_mutex_unlock(&bankMutex);
+    return n;
+}
+
+# Plays sample `sample` from the bank, starting exactly at `at` on the
+# audio clock (in seconds, see audioTime), or as soon as possible if
+# `at` is 0 or already past. Returns a voice id for audioStop.
+$cc proc audioPlay {int sample double at double gain bool loop} int {
+    if (sample < 0 || sample >= atomic_load(&bankCount)) {
+        FOLK_ERROR("audioPlay: No sample %d\n", sample);
+    }
+    AudioCommand command = {
+        .type = AUDIO_PLAY,
+        .voiceId = atomic_fetch_add(&nextVoiceId, 1),
+        .sample = sample,
+        .startFrame = at > 0 ? (uint64_t) (at * sampleRate + 0.5) : 0,
+        .gain = gain, .loop = loop,
+        .sentNs = at > 0 ? 0 : nowNs()
+    };
+    if (!commandSend(&command)) {
+        atomic_fetch_add(&statsDropped, 1);
+        FOLK_ERROR("audioPlay: Command queue is full\n");
+    }
+    return command.voiceId;
+}
+
+$cc proc audioStop {int voiceId} void {
+    AudioCommand command = { .type = AUDIO_STOP, .voiceId = voiceId };
+    if (!commandSend(&command)) {
+        atomic_fetch_add(&statsDropped, 1);
+    }
+}
+
+# The audio clock: seconds of audio mixed so far.
+$cc proc audioTime {} double {
+    return (double) atomic_load(&frameClock) / sampleRate;
+}
+$cc proc audioSampleRate {} int { return sampleRate; }
+
+# Returns a dict of playback stats: voices started and stolen,
+# commands dropped (queue full), and the latency from audioPlay to the
+# voice's first frame being mixed.
+$cc proc audioStats {} Jim_Obj* {
+    uint64_t started = atomic_load(&statsStarted);
+    double meanMs = started > 0 ?
+        (double) atomic_load(&statsLatencySumNs) / started / 1e6 : 0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "started %llu stolen %llu dropped %llu "
+             "latencyMeanMs %.3f latencyMaxMs %.3f lastStartFrame %llu",
+             (unsigned long long) started,
+             (unsigned long long) atomic_load(&statsStolen),
+             (unsigned long long) atomic_load(&statsDropped),
+             meanMs, (double) atomic_load(&statsLatencyMaxNs) / 1e6,
+             (unsigned long long) atomic_load(&statsLastStartFrame));
+    return Jim_NewStringObj(interp, buf, -1);
+}
+
+set audioLib [$cc compile]
@@ -0,0 +1,431 @@
+# evdev.tcl --
+#
+#     Reads key events from every keyboard (Linux evdev device) at
+#     once: one epoll set over all the devices, plus a kernel uevent
+#     socket so keyboards that are plugged in later get picked up.
+#     Events are decoded and resolved against cached keymaps in C, and
+#     `next` hands back all the keys that arrived together as one
+#     batch.
+#
+
+set cc [C]
+$cc include <linux/input.h>
+$cc include <linux/netlink.h>
+$cc include <sys/epoll.h>
+$cc include <sys/ioctl.h>
+$cc include <sys/socket.h>
+$cc include <sys/stat.h>
+$cc include <dirent.h>
+$cc include <errno.h>
+$cc include <fcntl.h>
+$cc include <limits.h>
+$cc include <math.h>
+$cc include <pthread.h>
+$cc include <stdlib.h>
+$cc include <string.h>
+$cc include <time.h>
+$cc include <unistd.h>
+
+$cc code {
+    #define EVDEV_MAX_DEVICES 64
+    #define EVDEV_MAX_KEYMAPS 16
+    #define KEYMAP_CODES 256
+    #define KEYMAP_MODS 16
+
+    // A keymap from lib/keymap.tcl, flattened into tables so we can
+    // resolve a key without touching any Tcl data.
+    typedef struct Keymap {
+        char* locale;
+        char* ksyms[KEYMAP_CODES][KEYMAP_MODS];
+        char* chars[KEYMAP_CODES][KEYMAP_MODS];
+    } Keymap;
+
+    typedef struct Device {
+        bool used;
+        // Added by hand with `watch` (not found by scanning
+        // /dev/input), so rescans leave it alone.
+        bool manual;
+        bool seen;
+
+        // The /dev/input/by-path/ link if there is one (so the name
+        // stays the same across reboots), otherwise the event node.
+        char name[PATH_MAX];
+        char node[PATH_MAX];
+        int fd;
+
+        // Weight of each modifier (Shift AltGr Control Alt) held down.
+        int modifiers[4];
+    } Device;
+
+    static const char* modifierNames[4] = {"Shift", "AltGr", "Control", "Alt"};
+    static const int modifierWeights[4] = {1, 2, 4, 8};
+
+    // Keymaps and device locales are set from other threads (whoever
+    // matches `is a keyboard with path ... locale ...`); everything
+    // else is only touched by the thread calling `next`.
+    static pthread_mutex_t evdevMutex = PTHREAD_MUTEX_INITIALIZER;
+    static Keymap* keymaps[EVDEV_MAX_KEYMAPS];
+    static int nKeymaps;
+    static char* defaultLocale;
+    static struct { char* name; char* locale; } deviceLocales[EVDEV_MAX_DEVICES];
+
+    static Device devices[EVDEV_MAX_DEVICES];
+    static int epfd = -1;
+    static int ueventFd = -1;
+    static bool devicesChanged;
+    static double rescanAt = -1;
+
+    static double monotonicNow() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    static Keymap* keymapFind(const char* locale) {
+        for (int i = 0; i < nKeymaps; i++) {
+            if (strcmp(keymaps[i]->locale, locale) == 0) { return keymaps[i]; }
+        }
+        return NULL;
+    }
+    static Keymap* keymapForDevice(Device* dev) {
+        const char* locale = defaultLocale;
+        for (int i = 0; i < EVDEV_MAX_DEVICES; i++) {
+            if (deviceLocales[i].name != NULL &&
+                strcmp(deviceLocales[i].name, dev->name) == 0) {
+                locale = deviceLocales[i].locale;
+                break;
+            }
+        }
+        return locale != NULL ? keymapFind(locale) : NULL;
+    }
+
+    // Same test udev uses for ID_INPUT_KEYBOARD: it has all of the
+    // first 31 keys (Esc, the number row, and the top letter rows).
+    static bool isKeyboardFd(int fd) {
+        unsigned long evBits[(EV_MAX + 8*sizeof(long)) / (8*sizeof(long))] = {0};
+        unsigned long keyBits[(KEY_MAX + 8*sizeof(long)) / (8*sizeof(long))] = {0};
+        if (ioctl(fd, EVIOCGBIT(0, sizeof(evBits)), evBits) < 0) { return false; }
+        if (!(evBits[0] & (1UL << EV_KEY))) { return false; }
+        if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keyBits)), keyBits) < 0) { return false; }
+        for (int key = 1; key < 32; key++) {
+            if (!(keyBits[key / (8*sizeof(long))] & (1UL << (key % (8*sizeof(long)))))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static int deviceOpen(const char* name, const char* node, bool checkKeyboard) {
+        int slot = -1;
+        for (int i = 0; i < EVDEV_MAX_DEVICES; i++) {
+            if (!devices[i].used) { slot = i; break; }
+        }
+        if (slot < 0) { return -1; }
+
+        int fd = open(node, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0 && errno == EACCES) {
+            fprintf(stderr, "evdev: Device %s is not readable. "
+                    "Attempting to change permissions.\n", node);
+            struct stat st;
+            if (stat(node, &st) == 0 &&
+                chmod(node, st.st_mode | S_IRUSR | S_IRGRP | S_IROTH) == 0) {
+                fd = open(node, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            }
+        }
+        if (fd < 0) { return -1; }
+        if (checkKeyboard && !isKeyboardFd(fd)) { close(fd); return -1; }
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = slot };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) { close(fd); return -1; }
+
+        Device* dev = &devices[slot];
+        memset(dev, 0, sizeof(*dev));
+        dev->used = true;
+        dev->seen = true;
+        dev->fd = fd;
+        snprintf(dev->name, sizeof(dev->name), "%s", name);
+        snprintf(dev->node, sizeof(dev->node), "%s", node);
+        devicesChanged = true;
+        return slot;
+    }
+    static void deviceClose(Device* dev) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+        close(dev->fd);
+        dev->used = false;
+        devicesChanged = true;
+    }
+
+    // Brings the open devices in line with /dev/input: opens new
+    // keyboards, closes ones that went away, and renames devices
+    // whose by-path link showed up after we opened them.
+    static void rescan() {
+        for (int i = 0; i < EVDEV_MAX_DEVICES; i++) { devices[i].seen = false; }
+
+        DIR* dir = opendir("/dev/input");
+        struct dirent* ent;
+        while (dir != NULL && (ent = readdir(dir)) != NULL) {
+            if (strncmp(ent->d_name, "event", 5) != 0) { continue; }
+            char node[PATH_MAX];
+            snprintf(node, sizeof(node), "/dev/input/%s", ent->d_name);
+
+            char name[PATH_MAX];
+            snprintf(name, sizeof(name), "%s", node);
+            DIR* byPath = opendir("/dev/input/by-path");
+            struct dirent* link;
+            while (byPath != NULL && (link = readdir(byPath)) != NULL) {
+                char linkPath[PATH_MAX], target[PATH_MAX];
+                snprintf(linkPath, sizeof(linkPath), "/dev/input/by-path/%s", link->d_name);
+                if (realpath(linkPath, target) != NULL && strcmp(target, node) == 0) {
+                    snprintf(name, sizeof(name), "%s", linkPath);
+                    break;
+                }
+            }
+            if (byPath != NULL) { closedir(byPath); }
+
+            bool isOpen = false;
+            for (int i = 0; i < EVDEV_MAX_DEVICES; i++) {
+                Device* dev = &devices[i];
+                if (!dev->used || strcmp(dev->node, node) != 0) { continue; }
+                dev->seen = true; isOpen = true;
+                if (!dev->manual && strcmp(dev->name, name) != 0) {
+                    snprintf(dev->name, sizeof(dev->name), "%s", name);
+                    devicesChanged = true;
+                }
+            }
+            if (!isOpen) { deviceOpen(name, node, true); }
+        }
+        if (dir != NULL) { closedir(dir); }
+
+        for (int i = 0; i < EVDEV_MAX_DEVICES; i++) {
+            if (devices[i].used && !devices[i].seen && !devices[i].manual) {
+                deviceClose(&devices[i]);
+            }
+        }
+    }
+
+    static void drainUevents() {
+        char buf[8192];
+        ssize_t len;
+        while ((len = recv(ueventFd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+            buf[len] = '\0';
+            // Give udev a moment to make the by-path link and set
+            // permissions before we look.
+            if (strstr(buf, "/input/") != NULL) { rescanAt = monotonicNow() + 0.5; }
+        }
+    }
+
+    // Reads all pending events from a device, appending resolved keys
+    // ({keyboard key state options}) to `keys`.
+    static void drainDevice(Jim_Interp* interp, Device* dev, Jim_Obj* keys) {
+        static const char* keyStates[3] = {"up", "down", "repeat"};
+        struct input_event evs[64];
+        for (;;) {
+            ssize_t len = read(dev->fd, evs, sizeof(evs));
+            if (len < 0 && (errno == EAGAIN || errno == EINTR)) { return; }
+            if (len <= 0) { deviceClose(dev); return; }
+
+            for (size_t i = 0; i < len / sizeof(struct input_event); i++) {
+                struct input_event* ev = &evs[i];
+                if (ev->type != EV_KEY || ev->value < 0 || ev->value > 2 ||
+                    ev->code >= KEYMAP_CODES) { continue; }
+
+                int mods = 0;
+                for (int m = 0; m < 4; m++) { mods += dev->modifiers[m]; }
+                Keymap* km = keymapForDevice(dev);
+                const char* key = km != NULL ? km->ksyms[ev->code][mods] : NULL;
+                if (key == NULL) { continue; }
+                const char* keychar = km->chars[ev->code][mods];
+
+                bool isDown = ev->value != 0;
+                for (int m = 0; m < 4; m++) {
+                    if (strcmp(key, modifierNames[m]) == 0) {
+                        dev->modifiers[m] = isDown * modifierWeights[m];
+                    }
+                }
+
+                double timestamp = floor(ev->input_event_sec * 1000.0 +
+                                         ev->input_event_usec / 1000.0) / 1000.0;
+                Jim_Obj* options = Jim_NewListObj(interp, NULL, 0);
+                Jim_ListAppendElement(interp, options, Jim_NewStringObj(interp, "timestamp", -1));
+                Jim_ListAppendElement(interp, options, Jim_NewDoubleObj(interp, timestamp));
+                if (mods & 1) {
+                    Jim_ListAppendElement(interp, options, Jim_NewStringObj(interp, "shift", -1));
+                    Jim_ListAppendElement(interp, options, Jim_NewIntObj(interp, 1));
+                }
+                // Excluding Shift.
+                bool modKeyNotHeld = mods <= 1;
+                if (keychar != NULL && modKeyNotHeld) {
+                    Jim_ListAppendElement(interp, options, Jim_NewStringObj(interp, "printable", -1));
+                    Jim_ListAppendElement(interp, options, Jim_NewStringObj(interp, keychar, -1));
+                }
+
+                Jim_Obj* entry[4] = {
+                    Jim_NewStringObj(interp, dev->name, -1),
+                    Jim_NewStringObj(interp, key, -1),
+                    Jim_NewStringObj(interp, keyStates[ev->value], -1),
+                    options
+                };
+                Jim_ListAppendElement(interp, keys, Jim_NewListObj(interp, entry, 4));
+            }
+        }
+    }
+
+    static Jim_Obj* deviceNames(Jim_Interp* interp) {
+        Jim_Obj* names = Jim_NewListObj(interp, NULL, 0);
+        for (int i = 0; i < EVDEV_MAX_DEVICES; i++) {
+            if (devices[i].used) {
+                Jim_ListAppendElement(interp, names,
+                                      Jim_NewStringObj(interp, devices[i].name, -1));
+            }
+        }
+        return names;
+    }
+}
+
+$cc proc init {} void {
+    if (epfd >= 0) { return; }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) { FOLK_ERROR("evdev: epoll_create1 failed: %s", strerror(errno)); }
+
+    // Without hotplug events (no permission, say) we just see the
+    // keyboards that were there at startup.
+    ueventFd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    if (ueventFd >= 0 && bind(ueventFd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(ueventFd); ueventFd = -1;
+    }
+    if (ueventFd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = UINT32_MAX };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, ueventFd, &ev);
+    } else {
+        fprintf(stderr, "evdev: Warning: No hotplug events; "
+                "will not notice new keyboards.\n");
+    }
+
+    pthread_mutex_lock(&evdevMutex);
+    rescan();
+    pthread_mutex_unlock(&evdevMutex);
+    devicesChanged = true;
+}
+
+# Reads `path` as a keyboard even if it doesn't look like one (or
+# isn't under /dev/input at all), and calls it `name`.
+$cc proc watch {char* name char* path} void {
+    pthread_mutex_lock(&evdevMutex);
+    int slot = deviceOpen(name, path, false);
+    if (slot >= 0) { devices[slot].manual = true; }
+    pthread_mutex_unlock(&evdevMutex);
+    if (slot < 0) { FOLK_ERROR("evdev: Could not watch %s (%s)", path, strerror(errno)); }
+}
+
+# Blocks until there are keys or the set of keyboards changes. Returns
+# {devicesChanged devices keys}, where each key is {keyboard key state
+# options}.
+$cc proc next {} Jim_Obj* {
+    Jim_Obj* keys = Jim_NewListObj(interp, NULL, 0);
+    for (;;) {
+        pthread_mutex_lock(&evdevMutex);
+        if (rescanAt >= 0 && monotonicNow() >= rescanAt) {
+            rescanAt = -1;
+            rescan();
+        }
+        bool changed = devicesChanged;
+        pthread_mutex_unlock(&evdevMutex);
+        if (changed || Jim_ListLength(interp, keys) > 0) { break; }
+
+        int timeout = rescanAt < 0 ? -1 :
+            (int) fmax(0, ceil((rescanAt - monotonicNow()) * 1000));
+        struct epoll_event evs[EVDEV_MAX_DEVICES + 1];
+        int n = epoll_wait(epfd, evs, EVDEV_MAX_DEVICES + 1, timeout);
+        if (n < 0 && errno != EINTR) {
+            FOLK_ERROR("evdev: epoll_wait failed: %s", strerror(errno));
+        }
+
+        pthread_mutex_lock(&evdevMutex);
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data.u32 == UINT32_MAX) { drainUevents(); continue; }
+            Device* dev = &devices[evs[i].data.u32];
+            if (dev->used) { drainDevice(interp, dev, keys); }
+        }
+        pthread_mutex_unlock(&evdevMutex);
+    }
+
+    pthread_mutex_lock(&evdevMutex);
+    Jim_Obj* ret[3] = {
+        Jim_NewIntObj(interp, devicesChanged),
+        deviceNames(interp),
+        keys
+    };
+    devicesChanged = false;
+    pthread_mutex_unlock(&evdevMutex);
+    return Jim_NewListObj(interp, ret, 3);
+}
+
+$cc proc hasKeymap {char* locale} bool {
+    pthread_mutex_lock(&evdevMutex);
+    bool ret = keymapFind(locale) != NULL;
+    pthread_mutex_unlock(&evdevMutex);
+    return ret;
+}
+# Caches `km` (from `keymap load $locale`) under `locale`. Keymaps are
+# never freed, since there are only ever a few of them.
+$cc proc loadKeymap {char* locale Jim_Obj* km} void {
+    Keymap* keymap = calloc(1, sizeof(Keymap));
+    keymap->locale = strdup(locale);
+    for (int table = 0; table < 2; table++) {
+        Jim_Obj* dict = Jim_ListGetIndex(interp, km, table);
+        int len; Jim_Obj** pairs = Jim_DictPairs(interp, dict, &len);
+        if (pairs == NULL) { free(keymap); FOLK_ERROR("evdev: Invalid keymap"); }
+        for (int i = 0; i + 1 < len; i += 2) {
+            int code, mod;
+            if (sscanf(Jim_String(pairs[i]), "%d %d", &code, &mod) != 2 ||
+                code < 0 || code >= KEYMAP_CODES || mod < 0 || mod >= KEYMAP_MODS) {
+                continue;
+            }
+            char** slot = table == 0 ? &keymap->ksyms[code][mod] : &keymap->chars[code][mod];
+            *slot = strdup(Jim_String(pairs[i + 1]));
+        }
+    }
+
+    pthread_mutex_lock(&evdevMutex);
+    if (keymapFind(locale) == NULL && nKeymaps < EVDEV_MAX_KEYMAPS) {
+        keymaps[nKeymaps++] = keymap;
+        keymap = NULL;
+    }
+    pthread_mutex_unlock(&evdevMutex);
+    if (keymap != NULL) {
+        for (int c = 0; c < KEYMAP_CODES; c++) {
+            for (int m = 0; m < KEYMAP_MODS; m++) {
+                free(keymap->ksyms[c][m]); free(keymap->chars[c][m]);
+            }
+        }
+        free(keymap->locale); free(keymap);
+    }
+}
+# Resolves keys from `keyboard` with the keymap for `locale`. The
+# first locale a keyboard gets stays until restart, as it always has;
+# later calls for that keyboard are ignored. If `keyboard` is "", sets
+# the default keymap instead.
+$cc proc useKeymap {char* keyboard char* locale} void {
+    pthread_mutex_lock(&evdevMutex);
+    if (keyboard[0] == '\0') {
+        free(defaultLocale);
+        defaultLocale = strdup(locale);
+    } else if (locale[0] != '\0') {
+        int slot = -1;
+        for (int i = 0; i < EVDEV_MAX_DEVICES; i++) {
+            if (deviceLocales[i].name == NULL) {
+                if (slot < 0) { slot = i; }
+            } else if (strcmp(deviceLocales[i].name, keyboard) == 0) {
+                slot = -1; break;
+            }
+        }
+        if (slot >= 0) {
+            deviceLocales[slot].name = strdup(keyboard);
+            deviceLocales[slot].locale = strdup(locale);
+        }
+    }
+    pthread_mutex_unlock(&evdevMutex);
+}
+
+set evdevLib [$cc compile]
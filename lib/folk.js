@@ -285,7 +285,11 @@ class FolkWS {
   }
 
   _onMessage(e) {
-    const [prefix, message] = loadList(e.data);
+    const [prefix, message, ...rest] = loadList(e.data);
+    if (prefix === '__deltas') {
+      this._onDeltas([message, ...rest]);
+      return;
+    }
     const channel = this.channels[prefix];
     if (!channel) {
       console.error(`received WS message with unknown channel prefix '${prefix}':`, e.data)
@@ -294,6 +298,38 @@ class FolkWS {
     channel.callback(message);
   }
 
+  // A batch of statement deltas, possibly for several channels:
+  // each entry is `channel snapshot {ref terms ...}`, `channel add
+  // ref terms`, or `channel remove ref`. The snapshot always comes
+  // first, on its own entry; adds of refs we already have (that were
+  // in the snapshot) are ignored.
+  _onDeltas(entries) {
+    for (const entry of entries) {
+      const [prefix, action, ref, terms] = loadList(entry);
+      const channel = this.channels[prefix];
+      if (!channel || !channel.statements) continue;
+
+      if (action === 'snapshot') {
+        const snapshot = loadList(ref);
+        channel.statements = {};
+        for (let i = 0; i < snapshot.length; i += 2) {
+          channel.statements[snapshot[i]] = loadList(snapshot[i + 1]);
+        }
+        channel.callback.snapshot?.({...channel.statements});
+      } else if (action === 'add') {
+        if (channel.statements[ref]) continue;
+        const statement = loadList(terms);
+        channel.statements[ref] = statement;
+        channel.callback.add?.(ref, statement);
+      } else if (action === 'remove') {
+        const statement = channel.statements[ref];
+        if (!statement) continue;
+        delete channel.statements[ref];
+        channel.callback.remove?.(ref, statement);
+      }
+    }
+  }
+
   // capture all messages with matching prefix
   createChannel(callback) {
     const prefix = `channel-${this.i++}`;
@@ -385,6 +421,55 @@ ${message} with environment [list [list this $chan __ctx $ctx __seq ${seqNumber}
     return channel;
   }
 
+  // Follows the statements matching `pattern` (one clause) with
+  // compact deltas instead of whole result sets. `callbacks` can have
+  // snapshot(statements), with an object from statement ref to terms,
+  // then add(ref, terms) and remove(ref, terms) as things change.
+  async deltas(pattern, callbacks) {
+    const channel = this.createChannel(callbacks);
+    channel.statements = {};
+    channel.retractKey = await this.send(tcl`Wish websocket $__ctx receives deltas of ${pattern} on channel ${channel.prefix}`);
+    return channel;
+  }
+
+  // Keeps the children of `el` in step with the keyed HTML fragments
+  // that HtmlWhen (web/web.folk) claims for `pattern`: one child per
+  // matching statement, marked with data-folk-key, added, morphed or
+  // removed on its own. The first snapshot also drops children (from
+  // the server-rendered page) whose match is already gone. `callbacks`
+  // are Idiomorph callbacks.
+  fragments(el, pattern, callbacks = {}) {
+    const keyOf = (terms) => terms[terms.length - 2];
+    const render = (terms) => {
+      const key = keyOf(terms), html = terms[terms.length - 1];
+      let child = el.querySelector(`:scope > [data-folk-key="${key}"]`);
+      if (!child) {
+        child = document.createElement('div');
+        child.style.display = 'contents';
+        child.dataset.folkKey = key;
+        el.appendChild(child);
+      }
+      if (window.Idiomorph) {
+        Idiomorph.morph(child, html, {morphStyle: 'innerHTML', callbacks});
+      } else {
+        child.innerHTML = html;
+      }
+    };
+    return this.deltas(`/someone/ claims the html fragment for ${pattern} is /key/ /html/`, {
+      snapshot: (statements) => {
+        const keys = new Set(Object.values(statements).map(keyOf));
+        for (const child of [...el.children]) {
+          if (!keys.has(child.dataset.folkKey)) child.remove();
+        }
+        Object.values(statements).forEach(render);
+      },
+      add: (ref, terms) => render(terms),
+      remove: (ref, terms) => {
+        el.querySelector(`:scope > [data-folk-key="${keyOf(terms)}"]`)?.remove();
+      },
+    });
+  }
+
   async watch(statement, callbacks) {
     const channel = this.createChannel((message) => {
       const [action, match] = loadList(message);
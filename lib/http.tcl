@@ -0,0 +1,1017 @@
+# http.tcl --
+#
+#     Native HTTP/1.1 server for web.folk. A single epoll thread owns
+#     every socket: it accepts connections, reads and parses requests
+#     (with bounded header and body sizes), and writes responses out.
+#
+#     Parsed requests go onto a queue that request workers (Tcl
+#     threads) pull from with `httpNextRequest`. A worker answers
+#     with `httpRespond` (Content-Length) or with `httpRespondStart`,
+#     `httpRespondChunk`... `httpRespondEnd` (chunked), from any
+#     thread. Streams of frames (like camera previews) can build each
+#     frame once with `httpFrameNew` and send it to every client with
+#     `httpRespondFrame`, which shares the buffer instead of copying
+#     it and skips frames for clients that fall behind. Static files go out with
+#     `httpRespondFile`, which sendfile()s them (or a precompressed
+#     .gz sibling) and answers If-None-Match with 304 Not Modified.
+#
+#     Connections are kept alive. Pipelined requests are answered in
+#     order, because we only parse the next request on a connection
+#     once the response to the previous one is complete.
+#
+#     Requests that ask to upgrade (WebSockets) are taken off the
+#     epoll thread entirely and handed, socket and all, to whoever
+#     calls `httpTakeUpgrade` (see the pipe passed to `httpServe`).
+#
+#     Linux-only (epoll, eventfd).
+
+set cc [C]
+$cc cflags -D_GNU_SOURCE
+$cc include <errno.h>
+$cc include <fcntl.h>
+$cc include <pthread.h>
+$cc include <stdatomic.h>
+$cc include <stdlib.h>
+$cc include <string.h>
+$cc include <strings.h>
+$cc include <unistd.h>
+$cc include <netinet/in.h>
+$cc include <netinet/tcp.h>
+$cc include <sys/epoll.h>
+$cc include <sys/eventfd.h>
+$cc include <sys/sendfile.h>
+$cc include <sys/socket.h>
+$cc include <sys/stat.h>
+
+$cc code {
+    #define HTTP_MAX_CONNECTIONS 1024
+    #define HTTP_MAX_HEADER_BYTES 16384
+    #define HTTP_MAX_HEADERS 64
+    #define HTTP_MAX_BODY_BYTES (16*1024*1024)
+    // A connection whose unsent output grows past this (a client
+    // that stopped reading a stream) gets dropped.
+    #define HTTP_MAX_PENDING_OUTPUT_BYTES (32*1024*1024)
+
+    // csubst drops the backslash from \r in proc bodies, so they
+    // use this instead.
+    #define CRLF "\r\n"
+
+    #define HTTP_LISTEN_TOKEN UINT64_MAX
+    #define HTTP_WAKE_TOKEN (UINT64_MAX - 1)
+
+    typedef struct HttpBuffer {
+        char* data;
+        size_t len;
+        size_t cap;
+    } HttpBuffer;
+
+    static void httpBufferAppend(HttpBuffer* b, const char* data, size_t len) {
+        if (b->len + len > b->cap) {
+            size_t cap = b->cap ? b->cap : 4096;
+            while (cap < b->len + len) { cap *= 2; }
+            b->data = realloc(b->data, cap);
+            b->cap = cap;
+        }
+        memcpy(b->data + b->len, data, len);
+        b->len += len;
+    }
+    static void httpBufferConsume(HttpBuffer* b, size_t n) {
+        memmove(b->data, b->data + n, b->len - n);
+        b->len -= n;
+    }
+    static void httpBufferFree(HttpBuffer* b) {
+        free(b->data);
+        *b = (HttpBuffer) {0};
+    }
+
+    typedef enum HttpConnectionState {
+        HTTP_CONN_FREE,
+        // Reading (and parsing) the next request.
+        HTTP_CONN_READING,
+        // A worker has the request; waiting for its response.
+        HTTP_CONN_DISPATCHED,
+        // Flushing the last response, then closing.
+        HTTP_CONN_CLOSING
+    } HttpConnectionState;
+
+    // Only the epoll thread touches connections, except for `gen`,
+    // which workers read to check if a connection is still open.
+    typedef struct HttpConnection {
+        // Bumped every time the slot is closed, so stale connection
+        // ids (which embed the gen) stop matching.
+        uint32_t _Atomic gen;
+
+        int fd;
+        HttpConnectionState state;
+        uint32_t interest;
+        // Of the request currently being answered.
+        bool keepAlive;
+
+        HttpBuffer in;
+        HttpBuffer out;
+        size_t outOffset;
+        // A shared frame to write once `out` is written, or NULL.
+        struct HttpFrame* frame;
+        size_t frameOffset;
+        // A file body to sendfile() once `out` is written, or -1.
+        int fileFd;
+        off_t fileOffset;
+        off_t fileEnd;
+    } HttpConnection;
+
+    static HttpConnection connections[HTTP_MAX_CONNECTIONS];
+
+    typedef struct HttpRequest {
+        struct HttpRequest* next;
+
+        uint64_t connId;
+        // Only set for upgrades, which own the socket.
+        int fd;
+        bool keepAlive;
+
+        char* method;
+        char* target;
+        char* version;
+        int nHeaders;
+        char* headerNames[HTTP_MAX_HEADERS];
+        char* headerValues[HTTP_MAX_HEADERS];
+        char* body;
+        size_t bodyLen;
+
+        // Header block and body are copied in here and parsed in
+        // place.
+        char storage[];
+    } HttpRequest;
+
+    // One frame of a stream, already framed as the body of a chunk
+    // (so with its trailing CRLF), shared by every connection it gets
+    // sent to.
+    typedef struct HttpFrame {
+        int _Atomic rc;
+        size_t len;
+        char data[];
+    } HttpFrame;
+    static void httpFrameUnref(HttpFrame* frame) {
+        if (frame != NULL && --frame->rc == 0) { free(frame); }
+    }
+
+    // A piece of response, on its way from a worker to the epoll
+    // thread.
+    typedef struct HttpOutput {
+        struct HttpOutput* next;
+
+        uint64_t connId;
+        // The first `headLen` bytes are a status line and headers
+        // (without the blank line). The epoll thread adds the
+        // Connection header, since only it knows whether it will
+        // keep the connection alive.
+        size_t headLen;
+        bool isFinal;
+        // Dropped, instead of queued, if the connection still has
+        // unsent output: a client that isn't keeping up with a stream
+        // skips frames rather than falling further behind.
+        bool isDroppable;
+        // Sent after `data` (and owned by the output until then), or
+        // -1.
+        int fileFd;
+        off_t fileLen;
+        // Likewise, sent after `data`, and the output holds a
+        // reference to it; or NULL.
+        HttpFrame* frame;
+
+        size_t len;
+        char data[];
+    } HttpOutput;
+
+    static int epfd = -1;
+    static int listenFd = -1;
+    static int wakeFd = -1;
+    static int upgradePipeWrite = -1;
+
+    static pthread_mutex_t requestsMutex = PTHREAD_MUTEX_INITIALIZER;
+    static pthread_cond_t requestsCond = PTHREAD_COND_INITIALIZER;
+    static HttpRequest* requestsHead = NULL;
+    static HttpRequest* requestsTail = NULL;
+
+    static pthread_mutex_t upgradesMutex = PTHREAD_MUTEX_INITIALIZER;
+    static HttpRequest* upgrades = NULL;
+
+    static pthread_mutex_t outputsMutex = PTHREAD_MUTEX_INITIALIZER;
+    static HttpOutput* outputsHead = NULL;
+    static HttpOutput* outputsTail = NULL;
+
+    static inline uint64_t httpConnId(int slot) {
+        return ((uint64_t) connections[slot].gen << 32) | (uint32_t) slot;
+    }
+    static HttpConnection* httpConnLookup(uint64_t connId) {
+        uint32_t slot = (uint32_t) connId;
+        if (slot >= HTTP_MAX_CONNECTIONS) { return NULL; }
+        HttpConnection* conn = &connections[slot];
+        if (conn->gen != (uint32_t) (connId >> 32)) { return NULL; }
+        return conn;
+    }
+
+    static inline bool httpConnHasPendingOutput(HttpConnection* conn) {
+        return conn->outOffset < conn->out.len || conn->frame != NULL ||
+            conn->fileFd != -1;
+    }
+
+    static void httpConnSetInterest(HttpConnection* conn) {
+        uint32_t interest = 0;
+        if (conn->state == HTTP_CONN_READING) { interest |= EPOLLIN; }
+        // We don't read while a response is underway, so watch for
+        // the peer closing instead; otherwise a long-lived (streaming)
+        // response only finds out once a write fails.
+        if (conn->state == HTTP_CONN_DISPATCHED) { interest |= EPOLLRDHUP; }
+        if (httpConnHasPendingOutput(conn)) { interest |= EPOLLOUT; }
+        if (interest == conn->interest) { return; }
+
+        struct epoll_event ev = {
+            .events = interest,
+            .data.u64 = (uint64_t) (conn - connections)
+        };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->interest = interest;
+    }
+
+    // Frees the slot. Closes the socket unless `keepFd`.
+    static void httpConnRelease(HttpConnection* conn, bool keepFd) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        if (!keepFd) { close(conn->fd); }
+        conn->fd = -1;
+        httpBufferFree(&conn->in);
+        httpBufferFree(&conn->out);
+        conn->outOffset = 0;
+        httpFrameUnref(conn->frame); conn->frame = NULL;
+        if (conn->fileFd != -1) { close(conn->fileFd); conn->fileFd = -1; }
+        conn->state = HTTP_CONN_FREE;
+        conn->gen++;
+    }
+
+    static void httpConnProcess(HttpConnection* conn);
+
+    // Writes as much pending output as the socket will take.
+    static void httpConnFlush(HttpConnection* conn) {
+        while (conn->outOffset < conn->out.len) {
+            ssize_t n = send(conn->fd, conn->out.data + conn->outOffset,
+                             conn->out.len - conn->outOffset, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) { continue; }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+                httpConnRelease(conn, false);
+                return;
+            }
+            conn->outOffset += n;
+        }
+        while (conn->outOffset == conn->out.len && conn->frame != NULL) {
+            HttpFrame* frame = conn->frame;
+            ssize_t n = send(conn->fd, frame->data + conn->frameOffset,
+                             frame->len - conn->frameOffset, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) { continue; }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+                httpConnRelease(conn, false);
+                return;
+            }
+            conn->frameOffset += n;
+            if (conn->frameOffset == frame->len) {
+                httpFrameUnref(frame); conn->frame = NULL;
+            }
+        }
+        while (conn->outOffset == conn->out.len && conn->frame == NULL &&
+               conn->fileFd != -1) {
+            ssize_t n = sendfile(conn->fd, conn->fileFd, &conn->fileOffset,
+                                 conn->fileEnd - conn->fileOffset);
+            if (n < 0) {
+                if (errno == EINTR) { continue; }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+                httpConnRelease(conn, false);
+                return;
+            }
+            if (n == 0 || conn->fileOffset >= conn->fileEnd) {
+                // Done (or the file shrank under us, in which case
+                // the client will see a short body).
+                close(conn->fileFd); conn->fileFd = -1;
+            }
+        }
+        if (!httpConnHasPendingOutput(conn)) {
+            conn->out.len = 0; conn->outOffset = 0;
+            if (conn->state == HTTP_CONN_CLOSING) {
+                httpConnRelease(conn, false);
+                return;
+            }
+            if (conn->state == HTTP_CONN_READING && conn->in.len > 0) {
+                // Pipelined requests may already be waiting.
+                httpConnProcess(conn);
+                return;
+            }
+        } else if (conn->out.len - conn->outOffset > HTTP_MAX_PENDING_OUTPUT_BYTES) {
+            httpConnRelease(conn, false);
+            return;
+        }
+        httpConnSetInterest(conn);
+    }
+
+    static void httpConnFail(HttpConnection* conn, const char* status) {
+        char response[256];
+        int len = snprintf(response, sizeof(response),
+                           "HTTP/1.1 %s\r\nConnection: close\r\nContent-Length: 0\r\n\r\n",
+                           status);
+        httpBufferAppend(&conn->out, response, len);
+        conn->state = HTTP_CONN_CLOSING;
+        httpConnFlush(conn);
+    }
+
+    static char* httpTrim(char* s) {
+        while (*s == ' ' || *s == '\t') { s++; }
+        char* end = s + strlen(s);
+        while (end > s && (end[-1] == ' ' || end[-1] == '\t')) { *--end = '\0'; }
+        return s;
+    }
+    static bool httpHasToken(const char* value, const char* token) {
+        return strcasestr(value, token) != NULL;
+    }
+
+    // Parses one request off the front of conn->in, if a whole one
+    // is there, and hands it off.
+    static void httpConnProcess(HttpConnection* conn) {
+        if (conn->state != HTTP_CONN_READING) { return; }
+
+        size_t searchLen = conn->in.len < HTTP_MAX_HEADER_BYTES ?
+            conn->in.len : HTTP_MAX_HEADER_BYTES;
+        char* headEnd = memmem(conn->in.data, searchLen, "\r\n\r\n", 4);
+        if (headEnd == NULL) {
+            if (conn->in.len >= HTTP_MAX_HEADER_BYTES) {
+                httpConnFail(conn, "431 Request Header Fields Too Large");
+                return;
+            }
+            httpConnSetInterest(conn);
+            return;
+        }
+        size_t headLen = headEnd - conn->in.data;
+
+        // Find the body length before we commit to anything.
+        size_t bodyLen = 0;
+        {
+            char* p = memmem(conn->in.data, headLen, "\r\n", 2);
+            while (p != NULL && p < headEnd) {
+                char* line = p + 2;
+                char* lineEnd = memmem(line, headEnd + 2 - line, "\r\n", 2);
+                if (lineEnd == NULL) { break; }
+                if (lineEnd - line > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+                    bodyLen = strtoull(line + 15, NULL, 10);
+                } else if (lineEnd - line > 18 && strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+                    httpConnFail(conn, "501 Not Implemented");
+                    return;
+                }
+                p = lineEnd;
+            }
+        }
+        if (bodyLen > HTTP_MAX_BODY_BYTES) {
+            httpConnFail(conn, "413 Content Too Large");
+            return;
+        }
+        size_t totalLen = headLen + 4 + bodyLen;
+        if (conn->in.len < totalLen) {
+            httpConnSetInterest(conn);
+            return;
+        }
+
+        HttpRequest* req = calloc(1, sizeof(HttpRequest) + headLen + 1 + bodyLen + 1);
+        memcpy(req->storage, conn->in.data, headLen);
+        req->storage[headLen] = '\0';
+        req->body = req->storage + headLen + 1;
+        memcpy(req->body, conn->in.data + headLen + 4, bodyLen);
+        req->body[bodyLen] = '\0';
+        req->bodyLen = bodyLen;
+        httpBufferConsume(&conn->in, totalLen);
+
+        // Request line.
+        char* saveptr;
+        char* line = strtok_r(req->storage, "\r\n", &saveptr);
+        char* lineSaveptr;
+        req->method = line ? strtok_r(line, " ", &lineSaveptr) : NULL;
+        req->target = req->method ? strtok_r(NULL, " ", &lineSaveptr) : NULL;
+        req->version = req->target ? strtok_r(NULL, " ", &lineSaveptr) : NULL;
+        if (req->version == NULL || strncmp(req->version, "HTTP/1.", 7) != 0) {
+            free(req);
+            httpConnFail(conn, "400 Bad Request");
+            return;
+        }
+
+        bool isHttp11 = strcmp(req->version, "HTTP/1.0") != 0;
+        req->keepAlive = isHttp11;
+        bool isUpgrade = false;
+        while ((line = strtok_r(NULL, "\r\n", &saveptr)) != NULL) {
+            char* colon = strchr(line, ':');
+            if (colon == NULL) { continue; }
+            if (req->nHeaders == HTTP_MAX_HEADERS) {
+                free(req);
+                httpConnFail(conn, "431 Request Header Fields Too Large");
+                return;
+            }
+            *colon = '\0';
+            char* name = httpTrim(line);
+            char* value = httpTrim(colon + 1);
+            req->headerNames[req->nHeaders] = name;
+            req->headerValues[req->nHeaders] = value;
+            req->nHeaders++;
+
+            if (strcasecmp(name, "Connection") == 0) {
+                if (httpHasToken(value, "close")) { req->keepAlive = false; }
+                if (httpHasToken(value, "keep-alive")) { req->keepAlive = true; }
+                if (httpHasToken(value, "upgrade")) { isUpgrade = true; }
+            }
+        }
+
+        if (isUpgrade) {
+            // Hand the socket over; it's not ours anymore.
+            req->fd = conn->fd;
+            httpConnRelease(conn, true);
+
+            pthread_mutex_lock(&upgradesMutex);
+            req->next = upgrades;
+            upgrades = req;
+            pthread_mutex_unlock(&upgradesMutex);
+            char c = 0;
+            if (write(upgradePipeWrite, &c, 1) != 1) {
+                fprintf(stderr, "http: Failed to signal upgrade\n");
+            }
+            return;
+        }
+
+        req->connId = httpConnId(conn - connections);
+        conn->keepAlive = req->keepAlive;
+        conn->state = HTTP_CONN_DISPATCHED;
+        httpConnSetInterest(conn);
+
+        pthread_mutex_lock(&requestsMutex);
+        if (requestsTail) { requestsTail->next = req; } else { requestsHead = req; }
+        requestsTail = req;
+        pthread_cond_signal(&requestsCond);
+        pthread_mutex_unlock(&requestsMutex);
+    }
+
+    static void httpConnRead(HttpConnection* conn) {
+        for (;;) {
+            if (conn->in.cap - conn->in.len < 4096) {
+                if (conn->in.len >= HTTP_MAX_HEADER_BYTES + HTTP_MAX_BODY_BYTES) {
+                    // Full; we'll read more once we've parsed some.
+                    break;
+                }
+                size_t cap = conn->in.cap ? conn->in.cap * 2 : 8192;
+                conn->in.data = realloc(conn->in.data, cap);
+                conn->in.cap = cap;
+            }
+            ssize_t n = recv(conn->fd, conn->in.data + conn->in.len,
+                             conn->in.cap - conn->in.len, 0);
+            if (n < 0) {
+                if (errno == EINTR) { continue; }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+                httpConnRelease(conn, false);
+                return;
+            }
+            if (n == 0) {
+                // Peer closed. Anything still being answered goes
+                // nowhere.
+                httpConnRelease(conn, false);
+                return;
+            }
+            conn->in.len += n;
+        }
+        httpConnProcess(conn);
+    }
+
+    static void httpAccept() {
+        for (;;) {
+            int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) { continue; }
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            int slot;
+            for (slot = 0; slot < HTTP_MAX_CONNECTIONS; slot++) {
+                if (connections[slot].state == HTTP_CONN_FREE) { break; }
+            }
+            if (slot == HTTP_MAX_CONNECTIONS) {
+                fprintf(stderr, "http: Too many connections\n");
+                close(fd);
+                continue;
+            }
+
+            HttpConnection* conn = &connections[slot];
+            conn->fd = fd;
+            conn->state = HTTP_CONN_READING;
+            conn->interest = EPOLLIN;
+            conn->keepAlive = false;
+            conn->frame = NULL;
+            conn->fileFd = -1;
+            struct epoll_event ev = { .events = EPOLLIN, .data.u64 = slot };
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        }
+    }
+
+    // Moves responses that workers have queued onto their
+    // connections.
+    static void httpDrainOutputs() {
+        pthread_mutex_lock(&outputsMutex);
+        HttpOutput* output = outputsHead;
+        outputsHead = outputsTail = NULL;
+        pthread_mutex_unlock(&outputsMutex);
+
+        while (output != NULL) {
+            HttpOutput* next = output->next;
+            HttpConnection* conn = httpConnLookup(output->connId);
+            if (conn != NULL && conn->state == HTTP_CONN_DISPATCHED &&
+                !(output->isDroppable && httpConnHasPendingOutput(conn))) {
+                if (conn->frame != NULL) {
+                    // Anything new has to go after the frame, so
+                    // stop sharing what's left of it.
+                    if (conn->outOffset == conn->out.len) {
+                        conn->out.len = 0; conn->outOffset = 0;
+                    }
+                    httpBufferAppend(&conn->out, conn->frame->data + conn->frameOffset,
+                                     conn->frame->len - conn->frameOffset);
+                    httpFrameUnref(conn->frame); conn->frame = NULL;
+                }
+                if (output->headLen > 0) {
+                    httpBufferAppend(&conn->out, output->data, output->headLen);
+                    const char* connection = conn->keepAlive ?
+                        "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+                    httpBufferAppend(&conn->out, connection, strlen(connection));
+                }
+                httpBufferAppend(&conn->out, output->data + output->headLen,
+                                 output->len - output->headLen);
+                if (output->fileFd != -1) {
+                    conn->fileFd = output->fileFd;
+                    conn->fileOffset = 0;
+                    conn->fileEnd = output->fileLen;
+                    output->fileFd = -1;
+                }
+                if (output->frame != NULL) {
+                    conn->frame = output->frame;
+                    conn->frameOffset = 0;
+                    output->frame = NULL;
+                }
+                if (output->isFinal) {
+                    conn->state = conn->keepAlive ? HTTP_CONN_READING : HTTP_CONN_CLOSING;
+                }
+                httpConnFlush(conn);
+            }
+            if (output->fileFd != -1) { close(output->fileFd); }
+            httpFrameUnref(output->frame);
+            free(output);
+            output = next;
+        }
+    }
+
+    static void* httpLoop(void* arg) {
+        struct epoll_event events[64];
+        for (;;) {
+            int n = epoll_wait(epfd, events, 64, -1);
+            if (n < 0) {
+                if (errno == EINTR) { continue; }
+                perror("http: epoll_wait");
+                return NULL;
+            }
+            for (int i = 0; i < n; i++) {
+                uint64_t token = events[i].data.u64;
+                if (token == HTTP_LISTEN_TOKEN) {
+                    httpAccept();
+                } else if (token == HTTP_WAKE_TOKEN) {
+                    uint64_t count;
+                    if (read(wakeFd, &count, sizeof(count)) < 0) {}
+                    httpDrainOutputs();
+                } else {
+                    HttpConnection* conn = &connections[token];
+                    if (conn->state == HTTP_CONN_FREE) { continue; }
+                    if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                        httpConnRelease(conn, false);
+                        continue;
+                    }
+                    if (events[i].events & EPOLLOUT) {
+                        httpConnFlush(conn);
+                        if (conn->state == HTTP_CONN_FREE) { continue; }
+                    }
+                    if (events[i].events & EPOLLIN) {
+                        httpConnRead(conn);
+                    }
+                }
+            }
+        }
+        return NULL;
+    }
+
+    static void httpPushOutput(HttpOutput* output) {
+        output->next = NULL;
+        pthread_mutex_lock(&outputsMutex);
+        if (outputsTail) { outputsTail->next = output; } else { outputsHead = output; }
+        outputsTail = output;
+        pthread_mutex_unlock(&outputsMutex);
+
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {}
+    }
+
+    // Normalizes a handler's `statusAndHeaders` (newline-separated,
+    // as handlers write them) to CRLF, dropping the framing headers
+    // that we set ourselves. Returns the new length.
+    static size_t httpFormatHead(char* out, const char* statusAndHeaders, int len) {
+        size_t outLen = 0;
+        const char* p = statusAndHeaders;
+        const char* end = statusAndHeaders + len;
+        while (p < end) {
+            const char* lineEnd = memchr(p, '\n', end - p);
+            if (lineEnd == NULL) { lineEnd = end; }
+            size_t lineLen = lineEnd - p;
+            if (lineLen > 0 && p[lineLen - 1] == '\r') { lineLen--; }
+            if (lineLen > 0 &&
+                !(lineLen >= 11 && strncasecmp(p, "Connection:", 11) == 0) &&
+                !(lineLen >= 15 && strncasecmp(p, "Content-Length:", 15) == 0) &&
+                !(lineLen >= 18 && strncasecmp(p, "Transfer-Encoding:", 18) == 0)) {
+                memcpy(out + outLen, p, lineLen);
+                outLen += lineLen;
+                out[outLen++] = '\r'; out[outLen++] = '\n';
+            }
+            p = lineEnd + 1;
+        }
+        return outLen;
+    }
+
+    static HttpOutput* httpOutputNew(uint64_t connId, Jim_Obj* statusAndHeadersObj,
+                                     const char* extraHeader, size_t extraHeaderLen,
+                                     const char* body, size_t bodyLen) {
+        int headInLen;
+        const char* headIn = statusAndHeadersObj ?
+            Jim_GetString(statusAndHeadersObj, &headInLen) : "";
+        if (statusAndHeadersObj == NULL) { headInLen = 0; }
+
+        // Worst case, every line gains a \r.
+        size_t cap = 2*headInLen + extraHeaderLen + bodyLen;
+        HttpOutput* output = malloc(sizeof(HttpOutput) + cap);
+        output->connId = connId;
+        output->isFinal = false;
+        output->isDroppable = false;
+        output->fileFd = -1;
+        output->frame = NULL;
+        output->headLen = 0;
+        if (statusAndHeadersObj != NULL) {
+            output->headLen = httpFormatHead(output->data, headIn, headInLen);
+            memcpy(output->data + output->headLen, extraHeader, extraHeaderLen);
+            output->headLen += extraHeaderLen;
+        }
+        if (bodyLen > 0) { memcpy(output->data + output->headLen, body, bodyLen); }
+        output->len = output->headLen + bodyLen;
+        return output;
+    }
+
+    // Static files: ETags are content hashes, cached by path and only
+    // recomputed when the file's mtime or size changes.
+    #define HTTP_MAX_STATIC_FILES 64
+    typedef struct HttpStaticFile {
+        char path[256];
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        char etag[24];
+    } HttpStaticFile;
+
+    static pthread_mutex_t staticFilesMutex = PTHREAD_MUTEX_INITIALIZER;
+    static HttpStaticFile staticFiles[HTTP_MAX_STATIC_FILES];
+    static int staticFilesCount = 0;
+
+    static void httpStaticFileEtag(const char* path, int fd, struct stat* st,
+                                   char etag[24]) {
+        pthread_mutex_lock(&staticFilesMutex);
+        HttpStaticFile* file = NULL;
+        for (int i = 0; i < staticFilesCount; i++) {
+            if (strcmp(staticFiles[i].path, path) == 0) { file = &staticFiles[i]; break; }
+        }
+        if (file != NULL && file->ino == st->st_ino && file->size == st->st_size &&
+            file->mtime.tv_sec == st->st_mtim.tv_sec &&
+            file->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            memcpy(etag, file->etag, 24);
+            pthread_mutex_unlock(&staticFilesMutex);
+            return;
+        }
+        pthread_mutex_unlock(&staticFilesMutex);
+
+        // FNV-1a over the contents.
+        uint64_t hash = 14695981039346656037ULL;
+        char buf[65536];
+        off_t offset = 0;
+        ssize_t n;
+        while ((n = pread(fd, buf, sizeof(buf), offset)) > 0) {
+            for (ssize_t i = 0; i < n; i++) {
+                hash = (hash ^ (uint8_t) buf[i]) * 1099511628211ULL;
+            }
+            offset += n;
+        }
+        snprintf(etag, 24, "\"%016llx\"", (unsigned long long) hash);
+
+        pthread_mutex_lock(&staticFilesMutex);
+        if (file == NULL || strcmp(file->path, path) != 0) {
+            file = staticFilesCount < HTTP_MAX_STATIC_FILES ?
+                &staticFiles[staticFilesCount++] :
+                &staticFiles[hash % HTTP_MAX_STATIC_FILES];
+            snprintf(file->path, sizeof(file->path), "%s", path);
+        }
+        file->ino = st->st_ino;
+        file->size = st->st_size;
+        file->mtime = st->st_mtim;
+        memcpy(file->etag, etag, 24);
+        pthread_mutex_unlock(&staticFilesMutex);
+    }
+
+    // Answers with the file at `path` (or `path`.gz, if the client
+    // takes gzip and the .gz is at least as new). Returns false,
+    // having sent nothing, if the file can't be opened.
+    static bool httpStaticRespond(uint64_t connId, const char* path,
+                                  const char* contentType,
+                                  const char* ifNoneMatch,
+                                  const char* acceptEncoding) {
+        struct stat st;
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            if (fd >= 0) { close(fd); }
+            return false;
+        }
+
+        bool gzipped = false;
+        if (httpHasToken(acceptEncoding, "gzip")) {
+            char gzPath[1024];
+            snprintf(gzPath, sizeof(gzPath), "%s.gz", path);
+            struct stat gzSt;
+            int gzFd = open(gzPath, O_RDONLY | O_CLOEXEC);
+            if (gzFd >= 0 && fstat(gzFd, &gzSt) == 0 && S_ISREG(gzSt.st_mode) &&
+                gzSt.st_mtim.tv_sec >= st.st_mtim.tv_sec) {
+                close(fd);
+                fd = gzFd; st = gzSt; path = gzPath;
+                gzipped = true;
+            } else if (gzFd >= 0) {
+                close(gzFd);
+            }
+        }
+
+        char etag[24];
+        httpStaticFileEtag(path, fd, &st, etag);
+
+        char head[1024];
+        HttpOutput* output;
+        if (strstr(ifNoneMatch, etag) != NULL || strcmp(ifNoneMatch, "*") == 0) {
+            int headLen = snprintf(head, sizeof(head),
+                                   "HTTP/1.1 304 Not Modified\r\n"
+                                   "ETag: %s\r\n"
+                                   "Cache-Control: no-cache\r\n"
+                                   "%s"
+                                   "Content-Length: 0\r\n",
+                                   etag, gzipped ? "Vary: Accept-Encoding\r\n" : "");
+            close(fd);
+            output = malloc(sizeof(HttpOutput) + headLen);
+            output->fileFd = -1;
+            memcpy(output->data, head, headLen);
+            output->headLen = output->len = headLen;
+        } else {
+            int headLen = snprintf(head, sizeof(head),
+                                   "HTTP/1.1 200 OK\r\n"
+                                   "Content-Type: %s\r\n"
+                                   "ETag: %s\r\n"
+                                   "Cache-Control: no-cache\r\n"
+                                   "%s"
+                                   "Content-Length: %lld\r\n",
+                                   contentType, etag,
+                                   gzipped ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" : "",
+                                   (long long) st.st_size);
+            output = malloc(sizeof(HttpOutput) + headLen);
+            output->fileFd = fd;
+            output->fileLen = st.st_size;
+            memcpy(output->data, head, headLen);
+            output->headLen = output->len = headLen;
+        }
+        output->connId = connId;
+        output->isFinal = true;
+        output->isDroppable = false;
+        output->frame = NULL;
+        httpPushOutput(output);
+        return true;
+    }
+
+    static Jim_Obj* httpRequestToObj(Jim_Interp* interp, HttpRequest* req) {
+        Jim_Obj* headersObj = Jim_NewListObj(interp, NULL, 0);
+        for (int i = 0; i < req->nHeaders; i++) {
+            Jim_ListAppendElement(interp, headersObj,
+                                  Jim_NewStringObj(interp, req->headerNames[i], -1));
+            Jim_ListAppendElement(interp, headersObj,
+                                  Jim_NewStringObj(interp, req->headerValues[i], -1));
+        }
+
+        Jim_Obj* objv[] = {
+            Jim_NewStringObj(interp, "conn", -1), Jim_NewWideObj(interp, req->connId),
+            Jim_NewStringObj(interp, "method", -1), Jim_NewStringObj(interp, req->method, -1),
+            Jim_NewStringObj(interp, "path", -1), Jim_NewStringObj(interp, req->target, -1),
+            Jim_NewStringObj(interp, "version", -1), Jim_NewStringObj(interp, req->version, -1),
+            Jim_NewStringObj(interp, "headers", -1), headersObj,
+            Jim_NewStringObj(interp, "body", -1), Jim_NewStringObj(interp, req->body, req->bodyLen),
+            Jim_NewStringObj(interp, "fd", -1), Jim_NewIntObj(interp, req->fd)
+        };
+        return Jim_NewListObj(interp, objv, sizeof(objv)/sizeof(objv[0]));
+    }
+}
+
+# Binds the port and starts the epoll thread. Errors if the port
+# can't be bound (so the caller can retry). Upgrade requests are
+# signaled by a byte on `upgradePipeWriteObj`.
+$cc proc httpServe {int port Jim_Obj* upgradePipeWriteObj} void {
+    if (listenFd != -1) { FOLK_ERROR("http: Already serving\n"); }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) { FOLK_ERROR("http: socket: %s\n", strerror(errno)); }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY)
+    };
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(fd, 512) < 0) {
+        int err = errno;
+        close(fd);
+        FOLK_ERROR("http: Unable to listen on port %d: %s\n", port, strerror(err));
+    }
+
+    upgradePipeWrite = Jim_AioFilehandle(interp, upgradePipeWriteObj);
+    if (upgradePipeWrite < 0) { FOLK_ERROR("http: upgradePipeWrite is invalid\n"); }
+
+    for (int i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+        connections[i].fd = -1;
+        connections[i].fileFd = -1;
+        connections[i].state = HTTP_CONN_FREE;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    listenFd = fd;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = HTTP_LISTEN_TOKEN };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenFd, &ev);
+    ev = (struct epoll_event) { .events = EPOLLIN, .data.u64 = HTTP_WAKE_TOKEN };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+    pthread_t th;
+    pthread_create(&th, NULL, httpLoop, NULL);
+    pthread_detach(th);
+}
+
+# Blocks until a request comes in. Returns a dict with conn, method,
+# path (the request target, including any query string), version,
+# headers (a name/value list), and body.
+$cc proc httpNextRequest {} Jim_Obj* {
+    pthread_mutex_lock(&requestsMutex);
+    while (requestsHead == NULL) {
+        pthread_cond_wait(&requestsCond, &requestsMutex);
+    }
+    HttpRequest* req = requestsHead;
+    requestsHead = req->next;
+    if (requestsHead == NULL) { requestsTail = NULL; }
+    pthread_mutex_unlock(&requestsMutex);
+
+    Jim_Obj* ret = httpRequestToObj(interp, req);
+    free(req);
+    return ret;
+}
+
+# Returns the next upgrade request (with its socket in `fd`), or an
+# empty string if there isn't one.
+$cc proc httpTakeUpgrade {} Jim_Obj* {
+    pthread_mutex_lock(&upgradesMutex);
+    HttpRequest* req = upgrades;
+    if (req != NULL) { upgrades = req->next; }
+    pthread_mutex_unlock(&upgradesMutex);
+
+    if (req == NULL) { return Jim_NewEmptyStringObj(interp); }
+    Jim_Obj* ret = httpRequestToObj(interp, req);
+    free(req);
+    return ret;
+}
+
+# HACK: Jim can't wrap an existing fd in a channel, so the caller
+# makes a throwaway channel (e.g., from `socket pair`) and we put the
+# socket in its place.
+$cc proc httpAdoptFd {int fd Jim_Obj* chan} void {
+    int chanFd = Jim_AioFilehandle(interp, chan);
+    if (chanFd < 0) { FOLK_ERROR("http: httpAdoptFd: Invalid channel\n"); }
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    if (dup2(fd, chanFd) < 0) { FOLK_ERROR("http: dup2: %s\n", strerror(errno)); }
+    close(fd);
+}
+
+$cc proc httpIsOpen {uint64_t connId} bool {
+    return httpConnLookup(connId) != NULL;
+}
+
+# Sends a whole response. `statusAndHeaders` is the status line and
+# headers, as handlers write them; we set Content-Length and
+# Connection.
+$cc proc httpRespond {uint64_t connId Jim_Obj* statusAndHeaders Jim_Obj* body} void {
+    int bodyLen; const char* bodyData = Jim_GetString(body, &bodyLen);
+    char contentLength[64];
+    int contentLengthLen = snprintf(contentLength, sizeof(contentLength),
+                                    "Content-Length: %d" CRLF, bodyLen);
+    HttpOutput* output = httpOutputNew(connId, statusAndHeaders,
+                                       contentLength, contentLengthLen,
+                                       bodyData, bodyLen);
+    output->isFinal = true;
+    httpPushOutput(output);
+}
+
+# Starts a chunked response; follow with any number of
+# httpRespondChunk and then httpRespondEnd.
+$cc proc httpRespondStart {uint64_t connId Jim_Obj* statusAndHeaders} void {
+    const char* transferEncoding = "Transfer-Encoding: chunked" CRLF;
+    httpPushOutput(httpOutputNew(connId, statusAndHeaders,
+                                 transferEncoding, strlen(transferEncoding),
+                                 NULL, 0));
+}
+
+# Returns false once the client has gone away, so streaming
+# responders know to stop.
+$cc proc httpRespondChunk {uint64_t connId Jim_Obj* data} bool {
+    if (httpConnLookup(connId) == NULL) { return false; }
+
+    int len; const char* s = Jim_GetString(data, &len);
+    if (len == 0) { return true; }
+
+    HttpOutput* output = malloc(sizeof(HttpOutput) + len + 32);
+    output->connId = connId;
+    output->headLen = 0;
+    output->isFinal = false;
+    output->isDroppable = false;
+    output->fileFd = -1;
+    output->frame = NULL;
+    int prefixLen = snprintf(output->data, 32, "%x" CRLF, len);
+    memcpy(output->data + prefixLen, s, len);
+    memcpy(output->data + prefixLen + len, CRLF, 2);
+    output->len = prefixLen + len + 2;
+    httpPushOutput(output);
+    return true;
+}
+
+# Builds one frame of a streaming (chunked) response, `head` and then
+# `len` bytes of `data`, to send to any number of clients with
+# httpRespondFrame. The caller holds one reference, which it gives
+# up with httpFrameRelease. Meant to be imported by C code that
+# already has the frame in a buffer (see web/camera-frame.folk).
+$cc proc httpFrameNew {char* head uint8_t* data size_t len} HttpFrame* {
+    size_t headLen = strlen(head);
+    HttpFrame* frame = malloc(sizeof(HttpFrame) + headLen + len + 2);
+    frame->rc = 1;
+    memcpy(frame->data, head, headLen);
+    memcpy(frame->data + headLen, data, len);
+    memcpy(frame->data + headLen + len, CRLF, 2);
+    frame->len = headLen + len + 2;
+    return frame;
+}
+$cc proc httpFrameRelease {HttpFrame* frame} void {
+    httpFrameUnref(frame);
+}
+# Sends `frame` as a single chunk, without copying it. Unlike
+# httpRespondChunk, the frame is skipped if the client hasn't taken
+# all of the output before it yet.
+$cc proc httpRespondFrame {uint64_t connId HttpFrame* frame} bool {
+    if (httpConnLookup(connId) == NULL) { return false; }
+
+    HttpOutput* output = malloc(sizeof(HttpOutput) + 32);
+    output->connId = connId;
+    output->headLen = 0;
+    output->isFinal = false;
+    output->isDroppable = true;
+    output->fileFd = -1;
+    frame->rc++;
+    output->frame = frame;
+    output->len = snprintf(output->data, 32, "%zx" CRLF, frame->len - 2);
+    httpPushOutput(output);
+    return true;
+}
+
+$cc proc httpRespondEnd {uint64_t connId} void {
+    const char* last = "0" CRLF CRLF;
+    HttpOutput* output = httpOutputNew(connId, NULL, NULL, 0, last, strlen(last));
+    output->isFinal = true;
+    httpPushOutput(output);
+}
+
+# Sends the file at `path` as a whole response, with an ETag (and a
+# 304 if it matches `ifNoneMatch`), from a .gz sibling if
+# `acceptEncoding` allows. Returns false, without responding, if
+# there is no such file.
+$cc proc httpRespondFile {uint64_t connId char* path char* contentType char* ifNoneMatch char* acceptEncoding} bool {
+    return httpStaticRespond(connId, path, contentType, ifNoneMatch, acceptEncoding);
+}
+
+$cc endcflags -lpthread
+set httpLib [$cc compile]
@@ -0,0 +1,454 @@
+# quad.tcl --
+#
+#     Implements the quad library. A quad is 4 vertices (top-left,
+#     top-right, bottom-right, bottom-left) in some space, like a
+#     camera or "display 0", and its string form is
+#     `space {v0 v1 v2 v3}`.
+#
+#     Quads are parsed into a C internal representation once, and
+#     derived properties (centroid, width, height, angle, bounding box)
+#     are computed on first use and cached on that representation, so
+#     calling several quad procs on the same value doesn't re-parse
+#     its string every time.
+#
+
+set cc [C]
+$cc include <math.h>
+$cc include <stdlib.h>
+$cc include <string.h>
+
+$cc code {
+    #define QUAD_MAX_VERTICES 8
+
+    typedef struct Quad {
+        int refCount;
+
+        char* space;
+        // The space as a Tcl list element (braced if it needs to be),
+        // for the string representation.
+        char* spaceElement;
+
+        int nVertices;
+        int dim; // 2 or 3
+        double v[QUAD_MAX_VERTICES][3];
+
+        bool hasDerived;
+        double centroid[3];
+        double width;
+        double height;
+        double angle;
+        double bbox[4]; // minX minY maxX maxY
+    } Quad;
+
+    extern Jim_ObjType quad_ObjType;
+
+    static Quad* quadNew(Jim_Obj* spaceObj, int nVertices, int dim) {
+        Jim_Obj* spaceList = Jim_NewListObj(interp, &spaceObj, 1);
+        Jim_IncrRefCount(spaceList);
+        const char* space = Jim_String(spaceObj);
+        const char* spaceElement = Jim_String(spaceList);
+
+        Quad* q = calloc(1, sizeof(Quad));
+        q->refCount = 1;
+        q->space = strdup(space);
+        q->spaceElement = strdup(spaceElement);
+        q->nVertices = nVertices;
+        q->dim = dim;
+        Jim_DecrRefCount(interp, spaceList);
+        return q;
+    }
+    static Quad* quadNewLike(Quad* src) {
+        Quad* q = calloc(1, sizeof(Quad));
+        q->refCount = 1;
+        q->space = strdup(src->space);
+        q->spaceElement = strdup(src->spaceElement);
+        q->nVertices = src->nVertices;
+        q->dim = src->dim;
+        return q;
+    }
+    static void quadRelease(Quad* q) {
+        if (--q->refCount > 0) { return; }
+        free(q->space);
+        free(q->spaceElement);
+        free(q);
+    }
+
+    void quad_freeIntRepProc(Jim_Interp* interp, Jim_Obj* objPtr) {
+        quadRelease((Quad*) objPtr->internalRep.ptr);
+    }
+    // Quads are immutable once made, so copies can share one.
+    void quad_dupIntRepProc(Jim_Interp* interp, Jim_Obj* srcPtr, Jim_Obj* dupPtr) {
+        Quad* q = (Quad*) srcPtr->internalRep.ptr;
+        q->refCount++;
+        dupPtr->internalRep.ptr = q;
+    }
+
+    // Same formatting as Jim uses for doubles, so a quad made here
+    // has the same string as the equivalent quad made with list
+    // operations (and statements about it dedupe the same way).
+    static int formatDouble(char* buf, double d) {
+        if (isnan(d)) { return sprintf(buf, "NaN"); }
+        if (isinf(d)) { return sprintf(buf, d < 0 ? "-Inf" : "Inf"); }
+        int len = sprintf(buf, "%.12g", d);
+        if (strpbrk(buf, ".e") == NULL) {
+            buf[len++] = '.'; buf[len++] = '0'; buf[len] = '\0';
+        }
+        return len;
+    }
+    void quad_updateStringProc(Jim_Obj* objPtr) {
+        Quad* q = (Quad*) objPtr->internalRep.ptr;
+
+        size_t cap = strlen(q->spaceElement) + 4 + q->nVertices * q->dim * 32;
+        char* s = Jim_Alloc(cap);
+        int i = sprintf(s, "%s {", q->spaceElement);
+        for (int j = 0; j < q->nVertices; j++) {
+            if (j > 0) { s[i++] = ' '; }
+            s[i++] = '{';
+            for (int k = 0; k < q->dim; k++) {
+                if (k > 0) { s[i++] = ' '; }
+                i += formatDouble(&s[i], q->v[j][k]);
+            }
+            s[i++] = '}';
+        }
+        s[i++] = '}';
+        s[i] = '\0';
+        objPtr->bytes = s;
+        objPtr->length = i;
+    }
+    Jim_ObjType quad_ObjType = (Jim_ObjType) {
+        .name = "quad",
+        .freeIntRepProc = quad_freeIntRepProc,
+        .dupIntRepProc = quad_dupIntRepProc,
+        .updateStringProc = quad_updateStringProc,
+    };
+
+    static void quadSetVertices(Quad* q, Jim_Obj* verticesObj) {
+        for (int j = 0; j < q->nVertices; j++) {
+            Jim_Obj* vObj = Jim_ListGetIndex(interp, verticesObj, j);
+            if (Jim_ListLength(interp, vObj) != q->dim) {
+                quadRelease(q);
+                FOLK_ERROR("quad: Vertices must all have %d coordinates", q->dim);
+            }
+            for (int k = 0; k < q->dim; k++) {
+                if (Jim_GetDouble(interp, Jim_ListGetIndex(interp, vObj, k),
+                                  &q->v[j][k]) != JIM_OK) {
+                    quadRelease(q);
+                    FOLK_ABORT();
+                }
+            }
+        }
+    }
+    static Quad* quadFromParts(Jim_Obj* spaceObj, Jim_Obj* verticesObj) {
+        int nVertices = Jim_ListLength(interp, verticesObj);
+        if (nVertices < 1 || nVertices > QUAD_MAX_VERTICES) {
+            FOLK_ERROR("quad: Invalid vertex count %d", nVertices);
+        }
+        int dim = Jim_ListLength(interp, Jim_ListGetIndex(interp, verticesObj, 0));
+        if (dim != 2 && dim != 3) {
+            FOLK_ERROR("quad: Invalid vertex dimension %d", dim);
+        }
+        Quad* q = quadNew(spaceObj, nVertices, dim);
+        quadSetVertices(q, verticesObj);
+        return q;
+    }
+    int quad_setFromAnyProc(Jim_Interp* interp, Jim_Obj* objPtr) {
+        if (objPtr->typePtr == &quad_ObjType) { return JIM_OK; }
+
+        // Keep the string rep: parsing it as a list would otherwise
+        // be the only copy of it.
+        Jim_String(objPtr);
+        if (Jim_ListLength(interp, objPtr) != 2) {
+            FOLK_ERROR("quad: Not a quad: %.100s", Jim_String(objPtr));
+        }
+        Quad* q = quadFromParts(Jim_ListGetIndex(interp, objPtr, 0),
+                                Jim_ListGetIndex(interp, objPtr, 1));
+        Jim_FreeIntRep(interp, objPtr);
+        objPtr->typePtr = &quad_ObjType;
+        objPtr->internalRep.ptr = q;
+        return JIM_OK;
+    }
+
+    static void quadDerive(Quad* q) {
+        if (q->hasDerived) { return; }
+        memset(q->centroid, 0, sizeof(q->centroid));
+        q->bbox[0] = q->bbox[1] = INFINITY;
+        q->bbox[2] = q->bbox[3] = -INFINITY;
+        for (int j = 0; j < q->nVertices; j++) {
+            for (int k = 0; k < 3; k++) { q->centroid[k] += q->v[j][k] / q->nVertices; }
+            q->bbox[0] = fmin(q->bbox[0], q->v[j][0]);
+            q->bbox[1] = fmin(q->bbox[1], q->v[j][1]);
+            q->bbox[2] = fmax(q->bbox[2], q->v[j][0]);
+            q->bbox[3] = fmax(q->bbox[3], q->v[j][1]);
+        }
+        if (q->nVertices == 4) {
+            double (*v)[3] = q->v;
+            #define DIST(a, b) sqrt(pow(v[a][0] - v[b][0], 2) + \
+                                    pow(v[a][1] - v[b][1], 2) + \
+                                    pow(v[a][2] - v[b][2], 2))
+            q->width = fmax(DIST(1, 0), DIST(2, 3));
+            q->height = fmax(DIST(2, 1), DIST(3, 0));
+            #undef DIST
+            q->angle = atan2(v[1][1] - v[0][1], v[1][0] - v[0][0]);
+        }
+        q->hasDerived = true;
+    }
+
+    static void vec3Unit(double out[3], const double a[3], const double b[3]) {
+        double d[3] = {a[0] - b[0], a[1] - b[1], a[2] - b[2]};
+        double n = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+        for (int k = 0; k < 3; k++) { out[k] = n > 0 ? d[k] / n : 0; }
+    }
+
+    // Parses a distance like `5mm`, `-2cm`, `0.1m`, `0.1` (meters) or
+    // (if `percentOf` isn't NaN) `10%`, into meters.
+    static double parseDistance(const char* who, Jim_Obj* obj, double percentOf) {
+        const char* s = Jim_String(obj);
+        char* unit;
+        double value = strtod(s, &unit);
+        if (unit == s) { FOLK_ERROR("quad %s: Invalid distance %s", who, s); }
+
+        if (*unit == '\0' || strcmp(unit, "m") == 0) { return value; }
+        if (strcmp(unit, "cm") == 0) { return value * 0.01; }
+        if (strcmp(unit, "mm") == 0) { return value * 0.001; }
+        if (strcmp(unit, "%") == 0 && !isnan(percentOf)) {
+            return value * 0.01 * percentOf;
+        }
+        FOLK_ERROR("quad %s: Invalid unit %s", who, unit);
+    }
+    static void ensureQuad(const char* who, Quad* q) {
+        if (q->nVertices != 4) {
+            FOLK_ERROR("quad %s: Needs 4 vertices, not %d", who, q->nVertices);
+        }
+    }
+}
+
+$cc argtype Quad* {
+    __ENSURE_OK(quad_setFromAnyProc(interp, $obj));
+    Quad* $argname = (Quad*) $obj->internalRep.ptr;
+}
+$cc rtype Quad* {
+    $robj = Jim_NewObj(interp);
+    $robj->bytes = NULL;
+    $robj->typePtr = &quad_ObjType;
+    $robj->internalRep.ptr = $rvalue;
+}
+
+$cc proc create {Jim_Obj* space Jim_Obj* vertices} Quad* {
+    return quadFromParts(space, vertices);
+}
+$cc proc space {Quad* q} Jim_Obj* {
+    return Jim_NewStringObj(interp, q->space, -1);
+}
+$cc proc vertices {Quad* q} Jim_Obj* {
+    Jim_Obj* vertexObjs[QUAD_MAX_VERTICES];
+    for (int j = 0; j < q->nVertices; j++) {
+        Jim_Obj* coordObjs[3];
+        for (int k = 0; k < q->dim; k++) {
+            coordObjs[k] = Jim_NewDoubleObj(interp, q->v[j][k]);
+        }
+        vertexObjs[j] = Jim_NewListObj(interp, coordObjs, q->dim);
+    }
+    return Jim_NewListObj(interp, vertexObjs, q->nVertices);
+}
+
+$cc proc centroid {Quad* q} Jim_Obj* {
+    quadDerive(q);
+    Jim_Obj* coordObjs[3];
+    for (int k = 0; k < q->dim; k++) {
+        coordObjs[k] = Jim_NewDoubleObj(interp, q->centroid[k]);
+    }
+    return Jim_NewListObj(interp, coordObjs, q->dim);
+}
+# Length of the longer of the top and bottom edges.
+$cc proc width {Quad* q} double {
+    ensureQuad("width", q); quadDerive(q); return q->width;
+}
+# Length of the longer of the left and right edges.
+$cc proc height {Quad* q} double {
+    ensureQuad("height", q); quadDerive(q); return q->height;
+}
+# Angle of the top edge in the x-y plane, in radians.
+$cc proc angle {Quad* q} double {
+    ensureQuad("angle", q); quadDerive(q); return q->angle;
+}
+# {minX minY maxX maxY} in the x-y plane.
+$cc proc bbox {Quad* q} Jim_Obj* {
+    quadDerive(q);
+    Jim_Obj* objs[4];
+    for (int i = 0; i < 4; i++) { objs[i] = Jim_NewDoubleObj(interp, q->bbox[i]); }
+    return Jim_NewListObj(interp, objs, 4);
+}
+
+# Moves the quad into `targetSpace` by the rigid transform v' = Rv + t
+# (which is what all the changers between spaces are right now).
+$cc proc rigidTransform {double[3][3] R double[3] t Jim_Obj* targetSpace Quad* q} Quad* {
+    Quad* ret = quadNew(targetSpace, q->nVertices, 3);
+    for (int j = 0; j < q->nVertices; j++) {
+        const double* v = q->v[j];
+        for (int k = 0; k < 3; k++) {
+            ret->v[j][k] = R[k][0]*v[0] + R[k][1]*v[1] + R[k][2]*v[2] + t[k];
+        }
+    }
+    return ret;
+}
+
+$cc proc scaleImpl {Quad* q Jim_Obj* args} Quad* {
+    ensureQuad("scale", q); quadDerive(q);
+
+    double sx = 1, sy = 1;
+    for (int i = 0; i + 1 < Jim_ListLength(interp, args); i += 2) {
+        const char* dim = Jim_String(Jim_ListGetIndex(interp, args, i));
+        Jim_Obj* valueObj = Jim_ListGetIndex(interp, args, i + 1);
+        const char* value = Jim_String(valueObj);
+        char* unit; double s = strtod(value, &unit);
+        if (unit == value) { FOLK_ERROR("quad scale: Invalid scale value %s", value); }
+
+        bool isWidth = strcmp(dim, "width") == 0;
+        if (!isWidth && strcmp(dim, "height") != 0) {
+            FOLK_ERROR("quad scale: Invalid dimension %s", dim);
+        }
+        if (strcmp(unit, "%") == 0) {
+            s *= 0.01;
+        } else if (*unit != '\0') {
+            // A length sets the size of the quad along that axis.
+            double size = isWidth ? q->width : q->height;
+            s = size > 0 ? parseDistance("scale", valueObj, NAN) / size : 1;
+        }
+        if (isWidth) { sx *= s; } else { sy *= s; }
+    }
+
+    // Each new vertex is the centroid, plus or minus half of the
+    // scaled edge vectors (along the quad's own width and height
+    // directions).
+    double (*v)[3] = q->v; const double* c = q->centroid;
+    double top[3], bottom[3], left[3], right[3];
+    for (int k = 0; k < 3; k++) {
+        top[k] = v[1][k] - v[0][k]; bottom[k] = v[2][k] - v[3][k];
+        left[k] = v[3][k] - v[0][k]; right[k] = v[2][k] - v[1][k];
+    }
+    Quad* ret = quadNewLike(q);
+    for (int k = 0; k < q->dim; k++) {
+        ret->v[0][k] = c[k] - 0.5*sx*top[k] - 0.5*sy*left[k];
+        ret->v[1][k] = c[k] + 0.5*sx*top[k] - 0.5*sy*right[k];
+        ret->v[2][k] = c[k] + 0.5*sx*bottom[k] + 0.5*sy*right[k];
+        ret->v[3][k] = c[k] - 0.5*sx*bottom[k] + 0.5*sy*left[k];
+    }
+    return ret;
+}
+
+$cc proc bufferImpl {Quad* q Jim_Obj* args} Quad* {
+    ensureQuad("buffer", q);
+
+    Quad* ret = quadNewLike(q);
+    memcpy(ret->v, q->v, sizeof(q->v));
+    double (*v)[3] = ret->v;
+    enum { TL, TR, BR, BL };
+    for (int i = 0; i + 1 < Jim_ListLength(interp, args); i += 2) {
+        const char* direction = Jim_String(Jim_ListGetIndex(interp, args, i));
+        double d = parseDistance("buffer", Jim_ListGetIndex(interp, args, i + 1), NAN);
+        if (d == 0) { continue; }
+
+        // Push the two vertices of that edge outward along the
+        // adjacent edges.
+        int a0, a1, b0, b1;
+        if (strcmp(direction, "top") == 0) {
+            a0 = TL; a1 = BL; b0 = TR; b1 = BR;
+        } else if (strcmp(direction, "bottom") == 0) {
+            a0 = BL; a1 = TL; b0 = BR; b1 = TR;
+        } else if (strcmp(direction, "left") == 0) {
+            a0 = TL; a1 = TR; b0 = BL; b1 = BR;
+        } else if (strcmp(direction, "right") == 0) {
+            a0 = TR; a1 = TL; b0 = BR; b1 = BL;
+        } else {
+            quadRelease(ret);
+            FOLK_ERROR("quad buffer: Invalid direction %s", direction);
+        }
+        double ua[3], ub[3];
+        vec3Unit(ua, v[a0], v[a1]); vec3Unit(ub, v[b0], v[b1]);
+        for (int k = 0; k < q->dim; k++) {
+            v[a0][k] += d * ua[k];
+            v[b0][k] += d * ub[k];
+        }
+    }
+    return ret;
+}
+
+$cc proc moveImpl {Quad* q Jim_Obj* args} Quad* {
+    ensureQuad("move", q); quadDerive(q);
+
+    Quad* ret = quadNewLike(q);
+    memcpy(ret->v, q->v, sizeof(q->v));
+    double (*v)[3] = q->v;
+    for (int i = 0; i + 1 < Jim_ListLength(interp, args); i += 2) {
+        const char* direction = Jim_String(Jim_ListGetIndex(interp, args, i));
+        bool vertical = strcmp(direction, "up") == 0 || strcmp(direction, "down") == 0;
+        double d = parseDistance("move", Jim_ListGetIndex(interp, args, i + 1),
+                                 vertical ? q->height : q->width);
+        if (d == 0) { continue; }
+
+        // Along the average of the quad's own two height (or width)
+        // edges, not the global x and y.
+        double a[3], b[3], dir[3];
+        if (vertical) {
+            for (int k = 0; k < 3; k++) {
+                a[k] = (v[0][k] + v[1][k]) / 2; b[k] = (v[3][k] + v[2][k]) / 2;
+            }
+        } else {
+            for (int k = 0; k < 3; k++) {
+                a[k] = (v[0][k] + v[3][k]) / 2; b[k] = (v[1][k] + v[2][k]) / 2;
+            }
+        }
+        if (strcmp(direction, "up") == 0 || strcmp(direction, "left") == 0) {
+            vec3Unit(dir, a, b);
+        } else if (strcmp(direction, "down") == 0 || strcmp(direction, "right") == 0) {
+            vec3Unit(dir, b, a);
+        } else {
+            quadRelease(ret);
+            FOLK_ERROR("quad move: Invalid direction %s", direction);
+        }
+        for (int j = 0; j < 4; j++) {
+            for (int k = 0; k < q->dim; k++) { ret->v[j][k] += d * dir[k]; }
+        }
+    }
+    return ret;
+}
+
+set impl [$cc compile]
+
+set quadLib [library create quadLib {impl} {
+    proc create {space vertices} { variable impl; $impl create $space $vertices }
+    proc space {q} { variable impl; $impl space $q }
+    proc vertices {q} { variable impl; $impl vertices $q }
+
+    proc centroid {q} { variable impl; $impl centroid $q }
+    proc width {q} { variable impl; $impl width $q }
+    proc height {q} { variable impl; $impl height $q }
+    proc angle {q} { variable impl; $impl angle $q }
+    proc bbox {q} { variable impl; $impl bbox $q }
+
+    # Returns a changer (see `the changer from space ... is`) that
+    # applies v' = Rv + t.
+    proc rigidChanger {R t} {
+        variable impl
+        list $impl rigidTransform $R $t
+    }
+
+    # Scales about the centroid of the quad, along the width and
+    # height directions of the quad. You can scale by a factor, a
+    # percentage, or set a specific length in meters/centimeters/
+    # millimeters (which just sets the quad size along that axis).
+    proc scale {q args} {
+        variable impl
+        if {[llength $args] == 1} {
+            set value [lindex $args 0]
+            set args [list width $value height $value]
+        }
+        $impl scaleImpl $q $args
+    }
+    # Pushes the given edges outward (or inward, for negative
+    # distances): `buffer $q top 5mm left 1cm ...`.
+    proc buffer {q args} { variable impl; $impl bufferImpl $q $args }
+    # Moves the quad left/right/up/down along the width and height
+    # directions of the quad (not the global x and y).
+    proc move {q args} { variable impl; $impl moveImpl $q $args }
+}]
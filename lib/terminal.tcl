@@ -19,6 +19,9 @@ $cc include <fcntl.h>
 $cc include <string.h>
 $cc include <sys/time.h>
 $cc include <signal.h>
+$cc include <poll.h>
+$cc include <errno.h>
+$cc include <sys/eventfd.h>
 $cc include "tmt.h"
 
 $cc struct VTerminal {
@@ -31,6 +34,21 @@ $cc struct VTerminal {
   int curs_r;
   int curs_c;
   int ncols;
+
+  // For termWait: rows libtmt has changed since we last reported
+  // them, and the cursor position we last reported.
+  int nrows;
+  int* dirty_rows;
+  int reported_curs_r;
+  int reported_curs_c;
+
+  // termDestroy sets destroyed and pokes wake_fd, so termWait stops
+  // waiting on the pty. The terminal's resources are freed by
+  // whichever of termDestroy and the last termWait (the one that
+  // returns alive 0) finishes second; each bumps released.
+  int destroyed;
+  int wake_fd;
+  int released;
 };
 
 $cc code {
@@ -49,6 +67,7 @@ $cc code {
       if (m == TMT_MSG_UPDATE) {
         for (size_t r = 0; r < s->nline; r++){
             if (s->lines[r]->dirty){
+                vt->dirty_rows[r] = 1;
                 for (size_t c = 0; c < s->ncol; c++){
                   *charAt(vt, r, c) = s->lines[r]->chars[c].c;
                 }
@@ -75,6 +94,15 @@ $cc code {
       *charAt(vt, vt->curs_r, vt->curs_c) = 0xDB; // block char: █
     }
   }
+
+  void termRelease(VTerminal *vt) {
+    if (__atomic_fetch_add(&vt->released, 1, __ATOMIC_SEQ_CST) != 1) { return; }
+    close(vt->pty_fd);
+    close(vt->wake_fd);
+    tmt_close(vt->tmt);
+    free(vt->display);
+    free(vt->dirty_rows);
+  }
 }
 
 $cc proc termCreate {int rows int cols char* cmd[]} VTerminal* {
@@ -89,6 +117,13 @@ $cc proc termCreate {int rows int cols char* cmd[]} VTerminal* {
   vt->curs_r = 0;
   vt->curs_c = 0;
   vt->ncols = cols;
+  vt->nrows = rows;
+  vt->dirty_rows = calloc(rows, sizeof(int));
+  vt->reported_curs_r = -1;
+  vt->reported_curs_c = -1;
+  vt->destroyed = 0;
+  vt->released = 0;
+  vt->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
 
   vt->display = malloc(sizeof(char[rows][cols + 1]));
   for (int r = 0; r < rows - 1; r++) {
@@ -115,14 +150,79 @@ $cc proc termCreate {int rows int cols char* cmd[]} VTerminal* {
   return vt;
 }
 
+# Kills the terminal's process and wakes up termWait. Frees the
+# terminal here if termWait has already returned alive 0 (the process
+# exited on its own), or else leaves that to termWait. (The VTerminal
+# struct itself stays allocated, so a key that's already on its way
+# to termWrite can't touch freed memory.)
 $cc proc termDestroy {VTerminal* vt} void {
   kill(vt->pid, SIGTERM);
-  close(vt->pty_fd);
-  free(vt->display);
-  free(vt);
+  __atomic_store_n(&vt->destroyed, 1, __ATOMIC_SEQ_CST);
+  uint64_t one = 1;
+  write(vt->wake_fd, &one, sizeof(one));
+  termRelease(vt);
+}
+
+# Sleeps until the terminal has output (or timeoutMs passes; -1 for
+# no timeout), feeds all of it to libtmt, and returns {alive rows
+# cursor}: rows is {row text row text ...} for just the rows that
+# changed, and cursor is {row col} if the cursor moved (otherwise
+# empty). alive is 0 once the terminal is destroyed or its process
+# has exited, and then termWait mustn't be called again.
+$cc proc termWait {VTerminal* vt int timeoutMs} Jim_Obj* {
+  struct pollfd fds[2] = {
+    { .fd = vt->pty_fd, .events = POLLIN },
+    { .fd = vt->wake_fd, .events = POLLIN }
+  };
+  while (poll(fds, 2, timeoutMs) < 0 && errno == EINTR) {}
+
+  char buf[PTYBUF];
+  bool alive = !__atomic_load_n(&vt->destroyed, __ATOMIC_SEQ_CST);
+  if (alive) {
+    for (;;) {
+      ssize_t r = read(vt->pty_fd, buf, sizeof(buf));
+      if (r > 0) { tmt_write(vt->tmt, buf, r); continue; }
+      // EIO means the process on the other end has exited.
+      if (r == 0 || (errno != EAGAIN && errno != EINTR)) { alive = false; }
+      break;
+    }
+  }
+
+  Jim_Obj* rows = Jim_NewListObj(interp, NULL, 0);
+  const TMTSCREEN *s = tmt_screen(vt->tmt);
+  char line[s->ncol + 1];
+  for (int r = 0; r < vt->nrows; r++) {
+    if (!vt->dirty_rows[r]) { continue; }
+    vt->dirty_rows[r] = 0;
+
+    int len = 0;
+    for (size_t c = 0; c < s->ncol; c++) {
+      wchar_t ch = s->lines[r]->chars[c].c;
+      line[c] = (ch >= ' ' && ch < 127) ? (char) ch : (ch == 0 ? ' ' : '?');
+      if (line[c] != ' ') { len = c + 1; }
+    }
+    Jim_ListAppendElement(interp, rows, Jim_NewIntObj(interp, r));
+    Jim_ListAppendElement(interp, rows, Jim_NewStringObj(interp, line, len));
+  }
+
+  Jim_Obj* cursor = Jim_NewListObj(interp, NULL, 0);
+  const TMTPOINT *c = tmt_cursor(vt->tmt);
+  if ((int) c->r != vt->reported_curs_r || (int) c->c != vt->reported_curs_c) {
+    vt->reported_curs_r = c->r;
+    vt->reported_curs_c = c->c;
+    Jim_ListAppendElement(interp, cursor, Jim_NewIntObj(interp, c->r));
+    Jim_ListAppendElement(interp, cursor, Jim_NewIntObj(interp, c->c));
+  }
+
+  if (__atomic_load_n(&vt->destroyed, __ATOMIC_SEQ_CST)) { alive = false; }
+  if (!alive) { termRelease(vt); }
+
+  Jim_Obj* ret[3] = { Jim_NewIntObj(interp, alive), rows, cursor };
+  return Jim_NewListObj(interp, ret, 3);
 }
 
 $cc proc termRead {VTerminal* vt} char* {
+  if (__atomic_load_n(&vt->destroyed, __ATOMIC_SEQ_CST)) { return ""; }
   ssize_t r = read(vt->pty_fd, iobuf, PTYBUF);
   if (r > 0) {
     tmt_write(vt->tmt, iobuf, r);
@@ -133,6 +233,7 @@ $cc proc termRead {VTerminal* vt} char* {
 }
 
 $cc proc termWrite {VTerminal* vt char* key} void {
+  if (__atomic_load_n(&vt->destroyed, __ATOMIC_SEQ_CST)) { return; }
   write(vt->pty_fd, key, strlen(key));
 }
 
@@ -211,6 +312,13 @@ set terminalLib [library create terminalLib {impl} {
     }
   }
 
+  # Blocks until the terminal has output, then returns {alive rows
+  # cursor}, with just the rows that changed (see termWait).
+  proc waitForChanges {term} {
+    variable impl
+    $impl termWait $term -1
+  }
+
   # Returns a newline separated string of terminal lines
   proc read {term} {
     variable impl
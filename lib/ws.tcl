@@ -6,15 +6,61 @@ $cc include <sys/socket.h>
 $cc include <string.h>
 $cc include <unistd.h>
 $cc include <fcntl.h>
+$cc include <pthread.h>
 
 $cc include <wslay/wslay.h>
 
 $cc code {
     typedef struct WsSession {
+        struct WsSession* next;
+        struct wslay_event_context* ctx;
+
         int fd;
         Jim_Obj* onMsgRecv;
+
+        // Statement deltas (see wsQueueDelta) waiting to go out
+        // together as one message, as a run of Tcl list elements.
+        char* deltas;
+        size_t deltasLen;
+        size_t deltasCap;
     } WsSession;
 
+    // Every live session, so that other threads can find a session
+    // by its ctx (and find out that it's gone). Also guards the
+    // sessions' deltas.
+    static pthread_mutex_t wsSessionsMutex = PTHREAD_MUTEX_INITIALIZER;
+    static WsSession* wsSessions = NULL;
+
+    static WsSession* wsSessionLookup(struct wslay_event_context* ctx) {
+        for (WsSession* session = wsSessions; session != NULL; session = session->next) {
+            if (session->ctx == ctx) { return session; }
+        }
+        return NULL;
+    }
+
+    // Queues a session's pending deltas as one message, unless wslay
+    // still has output queued for it: in that case the deltas keep
+    // accumulating until the socket catches up (see wsWritable).
+    // Call with wsSessionsMutex held.
+    static void wsFlushDeltas(WsSession* session) {
+        if (session->deltasLen == 0 || wslay_event_want_write(session->ctx)) {
+            return;
+        }
+        const char* prefix = "__deltas";
+        size_t prefixLen = strlen(prefix);
+        uint8_t* data = malloc(prefixLen + session->deltasLen);
+        memcpy(data, prefix, prefixLen);
+        memcpy(data + prefixLen, session->deltas, session->deltasLen);
+        struct wslay_event_msg msg = {
+            .opcode = WSLAY_TEXT_FRAME,
+            .msg = data,
+            .msg_length = prefixLen + session->deltasLen
+        };
+        wslay_event_queue_msg(session->ctx, &msg);
+        free(data);
+        session->deltasLen = 0;
+    }
+
     static ssize_t recv_callback(wslay_event_context_ptr ctx,
                                  uint8_t* buf, size_t len, int flags,
                                  void* user_data) {
@@ -103,13 +149,19 @@ $cc proc wsNew {Jim_Obj* chan Jim_Obj* onMsgRecv} wslay_event_context_ptr {
         FOLK_ERROR("web: Unable to open channel as file\n");
     }
 
-    WsSession* session = (WsSession*) malloc(sizeof(WsSession));
+    WsSession* session = (WsSession*) calloc(1, sizeof(WsSession));
     session->fd = fd;
     session->onMsgRecv = onMsgRecv;
     Jim_IncrRefCount(onMsgRecv);
 
     wslay_event_context_ptr ctx;
     wslay_event_context_server_init(&ctx, &callbacks, (void*) session);
+    session->ctx = ctx;
+
+    pthread_mutex_lock(&wsSessionsMutex);
+    session->next = wsSessions;
+    wsSessions = session;
+    pthread_mutex_unlock(&wsSessionsMutex);
     fprintf(stderr, "wsInit\n");
     return ctx;
 }
@@ -125,6 +177,11 @@ $cc proc wsWritable {wslay_event_context_ptr ctx} void {
     if (r != 0) {
         FOLK_ERROR("ws: wslay_event_send: %d", r);
     }
+    // Deltas that piled up while we were writing can go now.
+    pthread_mutex_lock(&wsSessionsMutex);
+    WsSession* session = wsSessionLookup(ctx);
+    if (session != NULL) { wsFlushDeltas(session); }
+    pthread_mutex_unlock(&wsSessionsMutex);
 }
 $cc proc wsWantRead {wslay_event_context_ptr ctx} bool {
     return wslay_event_want_read(ctx);
@@ -147,6 +204,41 @@ $cc proc wsEmitMsg {wslay_event_context_ptr ctx char* data} void {
     }
 }
 
+# Like wsEmitMsg, callable from any thread. Appends `entries` (a Tcl
+# list of statement deltas) to the session's pending deltas, which go
+# out as a single `__deltas ...` message on the next write that the
+# socket is ready for.
+$cc proc wsQueueDelta {wslay_event_context_ptr ctx char* entries} void {
+    size_t len = strlen(entries);
+    pthread_mutex_lock(&wsSessionsMutex);
+    WsSession* session = wsSessionLookup(ctx);
+    if (session == NULL) {
+        pthread_mutex_unlock(&wsSessionsMutex);
+        return;
+    }
+    bool wasEmpty = session->deltasLen == 0;
+    if (session->deltasLen + len + 1 > session->deltasCap) {
+        size_t cap = session->deltasCap ? session->deltasCap : 4096;
+        while (cap < session->deltasLen + len + 1) { cap *= 2; }
+        session->deltas = realloc(session->deltas, cap);
+        session->deltasCap = cap;
+    }
+    session->deltas[session->deltasLen++] = ' ';
+    memcpy(session->deltas + session->deltasLen, entries, len);
+    session->deltasLen += len;
+    pthread_mutex_unlock(&wsSessionsMutex);
+
+    if (wasEmpty) {
+        // A NULL message tells the web thread to flush deltas. Later
+        // deltas ride along with this one until it's flushed.
+        uint8_t pipedata[sizeof(ctx) + sizeof(char*)] = {0};
+        memcpy(&pipedata[0], &ctx, sizeof(ctx));
+        if (write(wsPipeWrite, pipedata, sizeof(pipedata)) != sizeof(pipedata)) {
+            FOLK_ERROR("ws: wsQueueDelta: write failed\n");
+        }
+    }
+}
+
 # This function runs on the web thread.
 $cc proc wsPipeReadMsg {} wslay_event_context_ptr {
     uint8_t pipedata[sizeof(wslay_event_context_ptr) + sizeof(char*)];
@@ -154,6 +246,14 @@ $cc proc wsPipeReadMsg {} wslay_event_context_ptr {
         wslay_event_context_ptr ctx; memcpy(&ctx, &pipedata[0], sizeof(ctx));
         char* data; memcpy(&data, &pipedata[sizeof(ctx)], sizeof(data));
 
+        if (data == NULL) {
+            pthread_mutex_lock(&wsSessionsMutex);
+            WsSession* session = wsSessionLookup(ctx);
+            if (session != NULL) { wsFlushDeltas(session); }
+            pthread_mutex_unlock(&wsSessionsMutex);
+            return ctx;
+        }
+
         struct wslay_event_msg msg = {
             .opcode = WSLAY_TEXT_FRAME,
             .msg = (unsigned char *)data,
@@ -168,10 +268,21 @@ $cc proc wsPipeReadMsg {} wslay_event_context_ptr {
 }
 
 $cc proc wsDestroy {wslay_event_context_ptr ctx} void {
-    // FIXME: free the WsSession
+    pthread_mutex_lock(&wsSessionsMutex);
+    for (WsSession** p = &wsSessions; *p != NULL; p = &(*p)->next) {
+        if ((*p)->ctx == ctx) {
+            WsSession* session = *p;
+            *p = session->next;
+            Jim_DecrRefCount(interp, session->onMsgRecv);
+            free(session->deltas);
+            free(session);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wsSessionsMutex);
     wslay_event_context_free(ctx);
 }
-$cc endcflags ./vendor/wslay/lib/.libs/libwslay.a
+$cc endcflags ./vendor/wslay/lib/.libs/libwslay.a -lpthread
 
 set wsLib [$cc compile]
 # This pipe is used so that other threads can queue up messages to
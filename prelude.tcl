@@ -793,6 +793,39 @@ if {[__isTracyEnabled]} {
         $tracyCpp proc zoneEnd {} void {
             ___tracy_emit_zone_end(__zoneCtx);
         }
+
+        # GPU zones from already-resolved timestamp queries (ticks
+        # of `period` ns each). The context is created on first use,
+        # calibrated to the first timestamp we see.
+        $tracyCpp code {
+            static bool __gpuContextCreated = false;
+            static uint16_t __gpuQueryId = 0;
+        }
+        $tracyCpp proc gpuZone {char* name uint64_t beginTicks uint64_t endTicks double period} void {
+            if (!__gpuContextCreated) {
+                ___tracy_emit_gpu_new_context_serial({
+                    .gpuTime = (int64_t) beginTicks,
+                    .period = (float) period,
+                    .context = 0, .flags = 0,
+                    .type = 2 /* Vulkan */
+                });
+                __gpuContextCreated = true;
+            }
+            uint64_t loc = ___tracy_alloc_srcloc_name(0, "gpu", 3, name, strlen(name),
+                                                      name, strlen(name), 0);
+            uint16_t beginQuery = __gpuQueryId++;
+            uint16_t endQuery = __gpuQueryId++;
+            ___tracy_emit_gpu_zone_begin_alloc_serial({
+                .srcloc = loc, .queryId = beginQuery, .context = 0
+            });
+            ___tracy_emit_gpu_zone_end_serial({ .queryId = endQuery, .context = 0 });
+            ___tracy_emit_gpu_time_serial({
+                .gpuTime = (int64_t) beginTicks, .queryId = beginQuery, .context = 0
+            });
+            ___tracy_emit_gpu_time_serial({
+                .gpuTime = (int64_t) endTicks, .queryId = endQuery, .context = 0
+            });
+        }
         return [$tracyCpp compile $tracyCid]
     }
     proc tracyTryLoad {} {tracySo} {
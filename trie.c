@@ -251,32 +251,35 @@ bool trieVariableNameIsNonCapturing(const char* varName) {
     return false;
 }
 
+typedef struct TrieResults {
+    uint64_t* results;
+    size_t maxResults;
+    int* resultsIdx;
+} TrieResults;
+static void trieResultsAppend(uint64_t value, void* arg) {
+    TrieResults* r = arg;
+    if (*r->resultsIdx < r->maxResults) {
+        r->results[(*r->resultsIdx)++] = value;
+    }
+}
+
 static void trieLookupAll(const Trie* trie,
-                          uint64_t* results, size_t maxResults,
-                          int* resultsIdx) {
+                          TrieVisitor visit, void* arg) {
     if (trie->hasValue) {
-        if (*resultsIdx < maxResults) {
-            results[(*resultsIdx)++] = trie->value;
-        }
+        visit(trie->value, arg);
     }
     for (int j = 0; j < trie->branchesCount; j++) {
-        trieLookupAll(trie->branches[j],
-                      results, maxResults, resultsIdx);
+        trieLookupAll(trie->branches[j], visit, arg);
     }
 }
 
 static void trieLookupImpl(bool isLiteral,
                            const Trie* trie, Clause* pattern, int patternIdx,
-                           uint64_t* results, size_t maxResults,
-                           int* resultsIdx) {
+                           TrieVisitor visit, void* arg) {
     int wordc = pattern->nTerms - patternIdx;
     if (wordc == 0) {
         if (trie->hasValue) {
-            if (*resultsIdx < maxResults) {
-                results[(*resultsIdx)++] = trie->value;
-            }
-            // TODO: Report if there are more than maxResults results?
-            return;
+            visit(trie->value, arg);
         }
         return;
     }
@@ -296,14 +299,12 @@ static void trieLookupImpl(bool isLiteral,
 
             trieLookupImpl(isLiteral, trie->branches[j],
                            pattern, patternIdx + 1,
-                           results, maxResults,
-                           resultsIdx);
+                           visit, arg);
 
         } else if (termType == TERM_TYPE_REST_VARIABLE) {
 
             trieLookupAll(trie->branches[j],
-                          results, maxResults,
-                          resultsIdx);
+                          visit, arg);
 
         } else {
             char keyVarName[100];
@@ -312,21 +313,18 @@ static void trieLookupImpl(bool isLiteral,
                 // Is the trie node a rest variable?
                 if (keyVarName[0] == '.' && keyVarName[1] == '.' && keyVarName[2] == '.') {
                     trieLookupAll(trie->branches[j],
-                                  results, maxResults,
-                                  resultsIdx);
+                                  visit, arg);
 
                 } else { // Or is the trie node a normal variable?
                     trieLookupImpl(isLiteral, trie->branches[j],
                                    pattern, patternIdx + 1,
-                                   results, maxResults,
-                                   resultsIdx);
+                                   visit, arg);
                 }
             } else {
                 if (termEq(trie->branches[j]->key, term)) {
                     trieLookupImpl(isLiteral, trie->branches[j],
                                    pattern, patternIdx + 1,
-                                   results, maxResults,
-                                   resultsIdx);
+                                   visit, arg);
                 }
             }
         }
@@ -380,9 +378,8 @@ static const Trie* trieRemoveImpl(bool isLiteral,
                                        resultsIdx);
 
         } else if (termType == TERM_TYPE_REST_VARIABLE) {
-            trieLookupAll(trie->branches[j],
-                          results, maxResults,
-                          resultsIdx);
+            trieLookupAll(trie->branches[j], trieResultsAppend,
+                          &(TrieResults) { results, maxResults, resultsIdx });
             // FIXME: this leaks
             newBranch = NULL;
 
@@ -392,8 +389,8 @@ static const Trie* trieRemoveImpl(bool isLiteral,
             if (!isLiteral && trieScanVariable(trie->branches[j]->key, keyVarName, 100)) {
                 // Is the trie node a rest variable?
                 if (keyVarName[0] == '.' && keyVarName[1] == '.' && keyVarName[2] == '.') {
-                    trieLookupAll(trie->branches[j],
-                                  results, maxResults, resultsIdx);
+                    trieLookupAll(trie->branches[j], trieResultsAppend,
+                                  &(TrieResults) { results, maxResults, resultsIdx });
                     // FIXME: this leaks
                     newBranch = NULL;
 
@@ -442,9 +439,8 @@ static const Trie* trieRemoveImpl(bool isLiteral,
 int trieLookup(const Trie* trie, Clause* pattern,
                uint64_t* results, size_t maxResults) {
     int resultCount = 0;
-    trieLookupImpl(false, trie, pattern, 0,
-                   results, maxResults,
-                   &resultCount);
+    trieLookupImpl(false, trie, pattern, 0, trieResultsAppend,
+                   &(TrieResults) { results, maxResults, &resultCount });
     /* fprintf(stderr, "trieLookup: (%s) -> %d\n", clauseToString(pattern), resultCount); */
     return resultCount;
 }
@@ -452,12 +448,16 @@ int trieLookup(const Trie* trie, Clause* pattern,
 int trieLookupLiteral(const Trie* trie, Clause* pattern,
                       uint64_t* results, size_t maxResults) {
     int resultCount = 0;
-    trieLookupImpl(true, trie, pattern, 0,
-                   results, maxResults,
-                   &resultCount);
+    trieLookupImpl(true, trie, pattern, 0, trieResultsAppend,
+                   &(TrieResults) { results, maxResults, &resultCount });
     return resultCount;
 }
 
+void trieVisit(const Trie* trie, Clause* pattern,
+               TrieVisitor visit, void* arg) {
+    trieLookupImpl(false, trie, pattern, 0, visit, arg);
+}
+
 // Note: does _literal_ matching only, for now.
 const Trie* trieRemove(const Trie* trie,
                        void *(*alloc)(size_t), void (*retire)(void*),
@@ -77,6 +77,13 @@ const Trie* trieRemove(const Trie* trie,
 int trieLookup(const Trie* trie, Clause* pattern,
                uint64_t* results, size_t maxResults);
 
+// Calls `visit` with the value of each clause matching `pattern`,
+// in trie order. Unlike trieLookup, this never drops results, so it's
+// up to `visit` to bound how much it keeps.
+typedef void (*TrieVisitor)(uint64_t value, void* arg);
+void trieVisit(const Trie* trie, Clause* pattern,
+               TrieVisitor visit, void* arg);
+
 // Only looks for literal matches of `literal` in the trie (does not
 // treat /variable/ as a variable). Used to check for an
 // already-existing statement whenever a statement is inserted.